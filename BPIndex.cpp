@@ -8,6 +8,9 @@
 * The fourth is to insert a new record into the record file. The program is 
 * compiled and ran through the Linux servers.
 *
+* The index engine itself is in BPIndex.h, which other programs can include
+* to use an index without going through this program.
+*
 * Error messages will occur upon the following situations:
 * - Invalid arguments due to incorrect number of parameters
 * - Invalid action code
@@ -25,6 +28,25 @@
 *				textfile.txt	is the record text file to be read
 *				data.idx		is the index binary file to be created
 *				keyLength		is the length of the key
+*	Optional switches:
+*				--bloom			also build a Bloom filter sidecar (data.idx.bloom)
+*								so finds for missing keys skip the index
+*				--bloom-fpr=r	Bloom filter false positive rate (default 0.01)
+*				--record-format=f	text (default) indexes textfile.txt in place;
+*								binary copies the records into 4096 byte pages in
+*								textfile.txt.rec, addressed by (page, slot);
+*								columnar does the same but keeps only the part
+*								after the key, which is read back from the index
+*				--shards=n		split the index by key range into n independent
+*								B+ tree files, data.idx.0 to data.idx.n-1, built in
+*								parallel; data.idx holds the shard boundaries,
+*								which are picked from a sample of the keys. The
+*								other commands work on data.idx as usual, with
+*								batches spread over the shards in parallel
+*				--compress-leaves	front code the keys and delta code the offsets
+*								in the leaf blocks, which then hold several
+*								times as many entries; the other commands read
+*								and insert into either layout
 *
 * To list the records:
 *	./ProgramName -list data.idx startingKey count
@@ -33,6 +55,21 @@
 *				data.idx		is the index binary file to be created
 *				startingKey		is the starting key to be searched
 *				count			is the desired number of records to be listed
+*	Optional switches:
+*				--index-only	list each key and its record offset from the
+*								index alone, without reading the records
+*
+* To count or list the keys in a range:
+*	./ProgramName -count data.idx startKey endKey
+*	./ProgramName -keys data.idx startKey endKey
+*		where:	ProgramName		is the name compiled through Linux
+*				-count			is the count command code
+*				-keys			is the key listing command code
+*				data.idx		is the index binary file to be created
+*				startKey		is the first key of the range
+*				endKey			is the last key of the range, included
+*	Both are answered from the leaf blocks of the index; the record file
+*	is not read.
 *
 * To find a record:
 *	./ProgramName -find data.idx key
@@ -41,12 +78,123 @@
 *				data.idx		is the index binary file to be created
 *				key				is the key to be searched
 *
+* To find a batch of records:
+*	./ProgramName -findbatch data.idx keys.txt
+*		where:	ProgramName		is the name compiled through Linux
+*				-findbatch		is the batch find command code
+*				data.idx		is the index binary file to be created
+*				keys.txt		is a text file with one key to be searched per line
+*	All lookups descend the tree together, one level at a time, so the
+*	reads of a whole level are in flight at once. -list uses the same
+*	engine to fetch the records of each leaf in one batch.
+*	Optional switches (also for -list):
+*				--io-depth=n	number of reads kept in flight (default 32)
+*				--io-engine=e	uring (default) uses io_uring when the kernel allows it;
+*								threads uses a pool of pread threads
+*				--mmap			resolve the lookups in the memory mapped index instead,
+*								interleaving --group-size lookups (default 8)
+*
+* To benchmark lookups:
+*	./ProgramName -bench data.idx
+*		where:	ProgramName		is the name compiled through Linux
+*				-bench			is the benchmark command code
+*				data.idx		is the index binary file to be created
+*	Keys sampled from the index are looked up in the memory mapped index,
+*	one after another and then interleaved in groups of 1 to 64.
+*	Optional switches:
+*				--lookups=n		number of lookups to time (default 1000000)
+*
 * To find a record:
 *	./ProgramName -insert data.idx "Key Data"
 *		where:	ProgramName		is the name compiled through Linux
 *				-insert			is the insert command code
 *				data.idx		is the index binary file to be created
 *				"Key Data"		is the record to be inserted
+*	Inserts copy the changed nodes to new pages and then switch the root,
+*	so -find, -findbatch, -list and -bench running at the same time see
+*	the tree either before or after the insert. Readers register the
+*	version they read in data.idx.readers; pages replaced by inserts are
+*	kept in data.idx.free and reused once no reader can reach them.
+*	Optional switches (also for -insertbatch):
+*				--write-buffer=n	append the records to a write-ahead log,
+*								data.idx.wal, instead of the tree, and flush them
+*								into the tree as one sorted batch once n records
+*								are buffered. Finds and lists read buffered
+*								records from the log until then
+*
+* To flush the write buffer:
+*	./ProgramName -flush data.idx
+*		where:	ProgramName		is the name compiled through Linux
+*				-flush			is the flush command code
+*				data.idx		is the index binary file to be created
+*	Moves every record in data.idx.wal into the tree now.
+*
+* To index records appended to the text file:
+*	./ProgramName -refresh data.idx
+*		where:	ProgramName		is the name compiled through Linux
+*				-refresh		is the refresh command code
+*				data.idx		is the index binary file to be updated
+*	The index keeps how many bytes of the text file it has read; only the
+*	whole lines after them are read, and they go into the tree as one
+*	sorted batch. Text records are indexed where they are in the file.
+*	Indexes created before the length was kept have to be created again.
+*
+* To insert a batch of records:
+*	./ProgramName -insertbatch data.idx records.txt
+*		where:	ProgramName		is the name compiled through Linux
+*				-insertbatch	is the batch insert command code
+*				data.idx		is the index binary file to be created
+*				records.txt		is a text file with one record to be inserted per line
+*	The whole batch becomes visible to readers at once.
+*
+* To rebuild an index:
+*	./ProgramName -rebuild data.idx
+*		where:	ProgramName		is the name compiled through Linux
+*				-rebuild		is the rebuild command code
+*				data.idx		is the index binary file to be rebuilt
+*	The tree is copied into a new file with full nodes, which replaces
+*	data.idx in one step while readers carry on. Shards are rebuilt in
+*	parallel; a single shard, such as data.idx.2, can be rebuilt on its
+*	own while the others stay in use. The new file gets block checksums
+*	if the old one had none.
+*	Optional switches:
+*				--compress-leaves	rebuild with compressed leaf blocks
+*
+* To serve requests from one long running process:
+*	./ProgramName -serve data.idx
+*		where:	ProgramName		is the name compiled through Linux
+*				-serve			is the serve command code
+*				data.idx		is the index binary file to be searched
+*	Reads one request per line from standard input until it ends or
+*	reads quit, and answers each with the lines -find or -insert would
+*	print followed by a blank line:
+*				find key		find a record
+*				insert Key Data	insert a record
+*				refresh			see records inserted by other processes
+*				stats			print the hits and size of the record cache
+*	Records found are kept in a cache of the keys asked for most, so
+*	repeated finds skip the tree and the record file; inserting a key
+*	drops its cached record.
+*	Optional switches (--cache-mb also for -findbatch):
+*				--cache-mb=n	memory for the record cache in megabytes
+*								(default 64 for -serve, otherwise none)
+*
+* To verify an index:
+*	./ProgramName -verify data.idx
+*		where:	ProgramName		is the name compiled through Linux
+*				-verify			is the verify command code
+*				data.idx		is the index binary file to be checked
+*	Every block of an index ends with a CRC32C checksum of the rest of it.
+*	The checksums are checked, along with key order within each node,
+*	keys against the separators above them, and record offsets against
+*	the size of the record file. Each level of the tree is checked on
+*	several threads at once. Indexes created before checksums were added
+*	get the other checks until they are rebuilt.
+*	Optional switches:
+*				--verify-threads=n	number of threads (default one per core)
+*	Optional switches for -find, -findbatch, -list, -count, -keys and -bench:
+*				--verify-checksums	check the checksum of every index block read;
+*								blocks that fail are reported and skipped
 *
 * Written by Gary Chen (gxc097020) at The University of Texas at Dallas
 * November 19, 2018
@@ -55,59 +203,49 @@
 #include <map>
 #include <iostream>
 #include <fstream>
-#include <sstream>
 #include <string>
 #include <vector>
-#include <bitset>
-#include <algorithm>
 #include <cstring>
-#include <string>
+#include <chrono>
+#include <random>
 #include <unistd.h>
+#include <sys/stat.h>
 
-using namespace std;
+#include "BPIndex.h"
 
-struct Metadata
-{
-	char fileName[256];
-	size_t keyLength = 0;
-	size_t root = 0;
-	size_t maxNode = 0;
-	size_t level = 0;
-};
+using namespace std;
+using namespace bpindex;
 
-Metadata metadata;
+map<string, string> options;		//Optional --name=value switches given on the command line
 
-struct Record
-{
-	char key[40];
-	string stringKey;
-	size_t offset;
-};
+const size_t EXPORT_BUFFER_SIZE = 1 << 20;		//Bytes an export gathers before each write
 
-struct Block
+//Streaming export of -list: records go through one large buffer straight to a file descriptor
+struct ExportWriter
 {
-	char block[1024];
-	size_t numEntry;
+	int fd = 1;
+	string format = "raw";			//raw lines, tsv key/offset/record, or binary length prefixed records
+	vector<char> buffer;
+	size_t used = 0;
+	bool failed = false;
 };
 
-Block internalKeyBlock;
-
-char nullKey[40] = { 'N','U','L','L' };
-char nullcmp[4] = { 'N','U','L','L' };
-
-size_t nullOffset = 0;
-size_t pointerHolder;
-
-int createBPTreeIndex(fstream &output, Record *data);
-void storeToStruct(Record *data, string line, size_t offset_count, size_t keyLength);
-int insertRecord(size_t offsetPtr, fstream &output, Record *data, size_t count, size_t option);
-size_t searchBPTreeIndexOffset(size_t offsetPtr, fstream &output, Record *data, size_t level, size_t count, size_t levelCount, size_t option);
-void splitNode(char block1[], size_t offsetPtr, fstream &output, Record *data, size_t count, size_t option);
-void addNewNodeAfterSplit(char splitBlock2[], char splitBlock3[], fstream &output, size_t offsetPtr, size_t offsetPtr2);
-size_t listRecordUsingIndex(size_t offsetPtr, fstream& indexFile, string startingKey, size_t count);
-size_t findRecordUsingIndex(size_t searchPtr, fstream& indexFile, string targetKey);
-bool icompare_pred(unsigned char a, unsigned char b);
-bool icompare(std::string const& a, std::string const& b);
+size_t listRecordUsingIndex(Index &index, string startingKey, size_t count);
+size_t exportRecordsUsingIndex(Index &index, string startingKey, size_t count, ExportWriter &writer);
+void exportAppend(ExportWriter &writer, const char *data, size_t length);
+void exportRecord(ExportWriter &writer, const char *key, size_t keyLength, bool buffered, size_t offset, const char *data, size_t length);
+bool exportFlush(ExportWriter &writer);
+size_t listKeysUsingIndex(Index &index, string startKey, string endKey);
+size_t findRecordUsingIndex(Index &index, string targetKey);
+void insertRecordUsingIndex(Index &index, string record);
+void findRecordsBatched(Index &index, vector<string> &targetKeys);
+void insertRecordsBatched(Index &index, vector<string> &records);
+void benchmarkLookups(Index &index, string fileName, size_t numLookups);
+void printRecordView(bool readable, const char *data, size_t length);
+void reportCorruptBlocks(Index &index);
+void printCacheStats(Index &index);
+IndexOptions indexOptionsFromSwitches();
+string getOption(string name, string defaultValue);
 
 /**************************************************************************
  * Driver function to run the program. Takes arguments from the user via
@@ -119,13 +257,25 @@ int main(int argc, char** argv) {
 	string fileTwoName;
 	string line;
 	int keySize;
-	int num_arg;
 
-	//Filling the NULL key array with 0s. The amount written will be specified by the metadata.keylength
-	for (int i = 4; i < 40; i++)
+	//Separate the optional --name=value switches from the positional arguments
+	vector<char*> positional;
+	for (int i = 0; i < argc; i++)
 	{
-		nullKey[i] = '0';
+		string arg = argv[i];
+		if (arg.compare(0, 2, "--") == 0 && arg.length() > 2)
+		{
+			size_t equals = arg.find('=');
+			if (equals == string::npos)
+				options[arg.substr(2)] = "";
+			else
+				options[arg.substr(2, equals - 2)] = arg.substr(equals + 1);
+		}
+		else
+			positional.push_back(argv[i]);
 	}
+	argc = positional.size();
+	argv = &positional[0];
 
 	code = argv[1];
 
@@ -133,15 +283,12 @@ int main(int argc, char** argv) {
 	{
 		if (icompare(code, "-create"))
 		{
-			ifstream fileOne;
-			fstream fileTwo;
+			Index index;
 
 			fileOneName = argv[2];
 			fileTwoName = argv[3];
 			keySize = atoi(argv[4]);
 
-			fileOne.open(fileOneName.c_str(), ios::in | ios::binary);
-			fileTwo.open(fileTwoName.c_str(), fstream::out | fstream::binary);
 			if (access(fileOneName.c_str(), F_OK) == -1)
 			{
 				cout << endl;
@@ -149,72 +296,86 @@ int main(int argc, char** argv) {
 				cout << endl;
 				return 0;
 			}
-			char *metaBlock = new char[1024];
 
-			//Initialize Metadata
-			strcpy(metadata.fileName, argv[2]);
+			//Binary formats copy the records into a paged record file next to the text file
+			IndexOptions indexOptions = indexOptionsFromSwitches();
+			string format = getOption("record-format", "text");
 
-			for (int i = strlen(metadata.fileName); i < 256; i++)
+			if (icompare(format, "binary"))
+				indexOptions.recordFormat = RECORD_FORMAT_BINARY;
+			else if (icompare(format, "columnar"))
+				indexOptions.recordFormat = RECORD_FORMAT_COLUMNAR;
+			else if (!icompare(format, "text"))
 			{
-				metadata.fileName[i] = '.';
+				cout << endl;
+				cout << "Error: Invalid record format. Valid formats are text, binary or columnar..." << endl;
+				cout << endl;
+				return 0;
 			}
 
-			metadata.keyLength = keySize;
-			metadata.maxNode = (1024 - 8) / (metadata.keyLength + 8);
-			strcpy(&metaBlock[0], metadata.fileName);
-			memcpy(&metaBlock[256], (char*)&metadata.keyLength, 8);
-			memcpy(&metaBlock[264], (char*)&metadata.root, 8);
-			memcpy(&metaBlock[272], (char*)&metadata.maxNode, 8);
-			memcpy(&metaBlock[280], (char*)&metadata.level, 8);
+			// Create index
+			size_t duplicates = 0;
 
-			fileTwo.seekp(0, ios::beg);
-			fileTwo.write(metaBlock, 1024);
+			if (!index.create(fileOneName, fileTwoName, keySize, indexOptions, &duplicates))
+			{
+				cout << endl;
+				cout << "Error: " << index.lastError() << endl;
+				cout << endl;
+				return 0;
+			}
 
-			fileTwo.close();
+			for (size_t i = 0; i < duplicates; i++)
+			{
+				cout << endl;
+				cout << "Duplicate Found." << endl;
+				cout << endl;
+			}
 
-			delete[] metaBlock;
+			cout << endl;
+			cout << "Index successfully created." << endl;
+			cout << endl;
 
-			fileTwo.open(fileTwoName.c_str(), fstream::in | fstream::out | fstream::binary);
+			return 0;
+		}
+		if (icompare(code, "-count") || icompare(code, "-keys"))
+		{
+			Index index;
+			string startKey;
+			string endKey;
 
-			// Create index
-			size_t offset_count = 0;
+			fileOneName = argv[2];
+			startKey = argv[3];
+			endKey = argv[4];
 
-			while (getline(fileOne, line))
+			if (access(fileOneName.c_str(), F_OK) == -1 || !index.open(fileOneName, indexOptionsFromSwitches()))
 			{
-				Record *data = new Record;
-
-				storeToStruct(data, line, offset_count, keySize);
-				createBPTreeIndex(fileTwo, data);
-
-				delete data;
-
-				offset_count = offset_count + line.length() + 1;
+				cout << endl;
+				cout << "Error: Unable to locate file. Please enter valid file name..." << endl;
+				cout << endl;
+				return 0;
 			}
 
-			fileOne.close();
-
 			cout << endl;
-			cout << "Index successfully created." << endl;
+			if (icompare(code, "-count"))
+				cout << index.count(startKey, endKey) << " keys from " << startKey << " to " << endKey << "." << endl;
+			else
+				listKeysUsingIndex(index, startKey, endKey);
+			reportCorruptBlocks(index);
 			cout << endl;
 
-			fileOne.close();
-
 			return 0;
 		}
 		if (icompare(code, "-list"))
 		{
-			fstream fileOne;
+			Index index;
 			string startingKey;
 			size_t count;
 
-			char starKey[40];
-
 			fileOneName = argv[2];
 			startingKey = argv[3];
 			count = atoi(argv[4]);
 
-			fileOne.open(fileOneName.c_str(), ios::in | ios::binary);
-			if (access(fileOneName.c_str(), F_OK) == -1)
+			if (access(fileOneName.c_str(), F_OK) == -1 || !index.open(fileOneName, indexOptionsFromSwitches()))
 			{
 				cout << endl;
 				cout << "Error: Unable to locate file. Please enter valid file name..." << endl;
@@ -222,41 +383,48 @@ int main(int argc, char** argv) {
 				return 0;
 			}
 
-			//Read in the metadablock and retrieve index information
-			fileOne.seekg(0, ios::beg);
-			fileOne.read(metadata.fileName, 256);
-			fileOne.read((char*)&metadata.keyLength, 8);
-			fileOne.read((char*)&metadata.root, 8);
-			fileOne.read((char*)&metadata.maxNode, 8);
-			fileOne.read((char*)&metadata.level, 8);
+			//An export writes nothing but the records, so that its output can be loaded as is
+			if (options.count("format") > 0 || options.count("output-fd") > 0)
+			{
+				ExportWriter writer;
+				writer.fd = atoi(getOption("output-fd", "1").c_str());
+				writer.format = getOption("format", "raw");
+
+				if (!icompare(writer.format, "raw") && !icompare(writer.format, "tsv") && !icompare(writer.format, "binary"))
+				{
+					cout << endl;
+					cout << "Error: Invalid output format. Valid formats are raw, tsv or binary..." << endl;
+					cout << endl;
+					return 0;
+				}
 
-			//Get the offset pointer to the leaf node (due to way index is structured, 
-			// we can always assume the first leaf block starts at 1024)
+				exportRecordsUsingIndex(index, startingKey, count, writer);
+				if (!exportFlush(writer))
+					cerr << "Error: Unable to write the export: " << strerror(errno) << endl;
+				if (index.corruptBlockCount() > 0)
+					cerr << "Error: " << index.corruptBlockCount() << " index block reads failed their checksum; the export may be incomplete." << endl;
+
+				return 0;
+			}
 
 			// List contents using index
 			cout << endl;
-			listRecordUsingIndex(1024, fileOne, startingKey, count);
+			listRecordUsingIndex(index, startingKey, count);
+			reportCorruptBlocks(index);
 			cout << endl;
 
-			fileOne.close();
-
 			return 0;
 		}
 	}
-	else if (argc == 4)
+	else if (argc == 3)
 	{
-		if (icompare(code, "-find"))
+		if (icompare(code, "-flush"))
 		{
-			fstream fileOne;
-			string targetKey;
-
-			char starKey[40];
+			Index index;
 
 			fileOneName = argv[2];
-			targetKey = argv[3];
 
-			fileOne.open(fileOneName.c_str(), ios::in | ios::binary);
-			if (access(fileOneName.c_str(), F_OK) == -1)
+			if (access(fileOneName.c_str(), F_OK) == -1 || !index.open(fileOneName, indexOptionsFromSwitches()))
 			{
 				cout << endl;
 				cout << "Error: Unable to locate file. Please enter valid file name..." << endl;
@@ -264,37 +432,24 @@ int main(int argc, char** argv) {
 				return 0;
 			}
 
-			//Read in the metadablock and retrieve index information
-			fileOne.seekg(0, ios::beg);
-			fileOne.read(metadata.fileName, 256);
-			fileOne.read((char*)&metadata.keyLength, 8);
-			fileOne.read((char*)&metadata.root, 8);
-			fileOne.read((char*)&metadata.maxNode, 8);
-			fileOne.read((char*)&metadata.level, 8);
-
-			//Get the offset pointer to the leaf node (due to way index is structured, 
-			// we can always assume the first leaf block starts at 1024)
-			// List contents using index
 			cout << endl;
-			findRecordUsingIndex(metadata.root, fileOne, targetKey);
-
-			//listRecordUsingIndex(1024, fileOne, startingKey, count, metadata);
+			if (!index.flush())
+				cout << "Error: " << index.lastError() << endl;
+			else
+				cout << "Write buffer successfully flushed." << endl;
 			cout << endl;
+
+			return 0;
 		}
-		if (icompare(code, "-insert"))
+		if (icompare(code, "-refresh"))
 		{
-			fstream indexFile;
-			
-			string record;
-
-			char starKey[40];
+			Index index;
+			size_t added = 0;
+			size_t duplicates = 0;
 
 			fileOneName = argv[2];
-			record = argv[3];
-			string recordString(record);
 
-			indexFile.open(fileOneName.c_str(), ios::in | ios::out | ios::binary);
-			if (access(fileOneName.c_str(), F_OK) == -1)
+			if (access(fileOneName.c_str(), F_OK) == -1 || !index.open(fileOneName, indexOptionsFromSwitches()))
 			{
 				cout << endl;
 				cout << "Error: Unable to locate file. Please enter valid file name..." << endl;
@@ -302,718 +457,696 @@ int main(int argc, char** argv) {
 				return 0;
 			}
 
-			//Read in the metadablock and retrieve index information
-			indexFile.seekg(0, ios::beg);
-			indexFile.read(metadata.fileName, 256);
-			indexFile.read((char*)&metadata.keyLength, 8);
-			indexFile.read((char*)&metadata.root, 8);
-			indexFile.read((char*)&metadata.maxNode, 8);
-			indexFile.read((char*)&metadata.level, 8);
+			cout << endl;
+			if (!index.catchUp(&added, &duplicates))
+				cout << "Error: " << index.lastError() << endl;
+			else
+				cout << added << " appended records successfully indexed, " << duplicates << " duplicates." << endl;
+			cout << endl;
 
-			fstream recordFile;
+			return 0;
+		}
+		if (icompare(code, "-rebuild"))
+		{
+			Index index;
 
-			size_t fileNameSize = 0;
+			fileOneName = argv[2];
 
-			for (int i = 0; i < 256; i++)			//Get length of file name
+			if (access(fileOneName.c_str(), F_OK) == -1 || !index.open(fileOneName, indexOptionsFromSwitches()))
 			{
-				if (metadata.fileName[i] != '.')
-					fileNameSize++;
+				cout << endl;
+				cout << "Error: Unable to locate file. Please enter valid file name..." << endl;
+				cout << endl;
+				return 0;
 			}
 
-			string recordFileName(metadata.fileName, fileNameSize + 1);
-			recordFile.open(recordFileName.c_str(), ios::in | ios::out | ios::binary);
-
-			recordFile.seekg(0, ios::end);					//First two lines determines the length (offset pointer)
-			size_t offsetEnd = recordFile.tellg();
-			recordFile.seekg(0, ios::beg);
-
-			//Store into struct
-			Record *entry = new Record;
-			memcpy(&entry->key[0], argv[3], metadata.keyLength);
-			entry->offset = offsetEnd;
-
-			//Recursive find the leaf node block. Returns the byte pointer to the leaf node block
-			size_t offsetPtr;
-			offsetPtr = searchBPTreeIndexOffset(metadata.root, indexFile, entry, metadata.level, 0, 1, 1);
-
-			//Count the number of record in the leaf node block
-			size_t count = 0;
-			char *buffer = new char[1024];
-			char *keyBuff = new char[40];
-			char *checkNULL = new char[4];
-			size_t level = 0;
+			cout << endl;
+			if (!index.rebuild())
+				cout << "Error: " << index.lastError() << endl;
+			else
+				cout << "Index successfully rebuilt." << endl;
+			cout << endl;
 
-			indexFile.seekg(0, ios::beg);
-			indexFile.seekg(offsetPtr, ios::beg);		//Go to leaf node block
-			indexFile.read(buffer, 1024);				// Write the entire block to char array for modification
+			return 0;
+		}
+		if (icompare(code, "-serve"))
+		{
+			Index index;
+			IndexOptions indexOptions = indexOptionsFromSwitches();
 
-			int pos = 0;
+			fileOneName = argv[2];
 
-			char *nullcmp = new char[4];
-			strncpy(&nullcmp[0], nullKey, 4);
+			//A server lives long enough for the record cache to pay off, so it has one unless told otherwise
+			if (options.count("cache-mb") == 0)
+				indexOptions.cacheBytes = (size_t)64 * 1048576;
 
-			while (count <= metadata.maxNode)
+			if (access(fileOneName.c_str(), F_OK) == -1 || !index.open(fileOneName, indexOptions))
 			{
-				strncpy(keyBuff, buffer + pos, metadata.keyLength);
-				strncpy(checkNULL, keyBuff, 4);
+				cout << endl;
+				cout << "Error: Unable to locate file. Please enter valid file name..." << endl;
+				cout << endl;
+				return 0;
+			}
 
-				if (checkNULL[0] == nullcmp[0] && checkNULL[1] == nullcmp[1] && checkNULL[2] == nullcmp[2] && checkNULL[3] == nullcmp[3])
+			//One request per line; each answer ends with a blank line
+			while (getline(cin, line))
+			{
+				if (!line.empty() && line[line.length() - 1] == '\r')
+					line.erase(line.length() - 1);
+
+				size_t space = line.find(' ');
+				string request = line.substr(0, space);
+				string argument = space == string::npos ? "" : line.substr(space + 1);
+
+				if (icompare(request, "find"))
+					findRecordUsingIndex(index, argument);
+				else if (icompare(request, "insert"))
+					insertRecordUsingIndex(index, argument);
+				else if (icompare(request, "refresh"))
+				{
+					index.refresh();
+					cout << "Index refreshed." << endl;
+				}
+				else if (icompare(request, "stats"))
+					printCacheStats(index);
+				else if (icompare(request, "quit"))
 					break;
 				else
-					count++;
+					cout << "Error: Invalid request. Valid requests are find, insert, refresh, stats or quit..." << endl;
 
-				pos = pos + metadata.keyLength + 8;
+				cout << endl;
 			}
 
-			delete[] keyBuff;
-			delete[] buffer;
-			char nl[1] = { '\n' };
+			return 0;
+		}
+		if (icompare(code, "-verify"))
+		{
+			Index index;
+			VerifyResult result;
+
+			fileOneName = argv[2];
 
-			if (insertRecord(offsetPtr, indexFile, entry, count, 3) == 0)
+			if (access(fileOneName.c_str(), F_OK) == -1 || !index.open(fileOneName, indexOptionsFromSwitches()))
 			{
 				cout << endl;
-				cout << "Record successfully inserted." << endl;
+				cout << "Error: Unable to locate file. Please enter valid file name..." << endl;
 				cout << endl;
+				return 0;
+			}
 
-				recordFile.seekg(offsetEnd, ios::beg);
-				recordFile.write(record.c_str(), strlen(recordString.c_str()));
-				recordFile.write(nl, 1);
+			cout << endl;
+			if (!index.verify(result))
+				cout << "Error: " << index.lastError() << endl;
+			else
+			{
+				for (size_t i = 0; i < result.problems.size(); i++)
+					cout << result.problems[i] << endl;
+				if (!result.problems.empty())
+					cout << endl;
+
+				cout << "Checked " << result.blocks << " blocks and " << result.keys << " keys: ";
+				if (result.problems.empty())
+					cout << "index is sound." << endl;
+				else
+					cout << result.problems.size() << " problems found." << endl;
 			}
+			cout << endl;
 
 			return 0;
 		}
-	}
+		if (icompare(code, "-bench"))
+		{
+			Index index;
 
-	else if (!icompare(code, "-create") && !icompare(code, "-list") && !icompare(code, "-find") && !icompare(code, "-insert"))
-	{
-		cout << endl;
-		cout << "Error: Invalid code. Valid codes are -c or -l. Please enter a valid code..." << endl;
-		cout << endl;
-		return 0;
-	}
-}
+			fileOneName = argv[2];
 
-/**************************************************************************
- * Function to store records to struct
- **************************************************************************/
-void storeToStruct(Record *data, string line, size_t offset_count, size_t keyLength)
-{
-	string stringKey;
-	int lineCount = 0;
+			if (access(fileOneName.c_str(), F_OK) == -1 || !index.open(fileOneName, indexOptionsFromSwitches()))
+			{
+				cout << endl;
+				cout << "Error: Unable to locate file. Please enter valid file name..." << endl;
+				cout << endl;
+				return 0;
+			}
 
-	stringKey = line.substr(0, keyLength);
-	strcpy(data->key, stringKey.c_str());
-	data->stringKey = stringKey;
-	data->offset = offset_count;
-}
+			cout << endl;
+			benchmarkLookups(index, fileOneName, atoi(getOption("lookups", "1000000").c_str()));
+			reportCorruptBlocks(index);
+			cout << endl;
 
-/**************************************************************************
- * Function to store records to struct
- **************************************************************************/
-int createBPTreeIndex(fstream &output, Record *data)
-{
-	//Update Metadata to point to first root node block
-	if (metadata.root == 0)
+			return 0;
+		}
+	}
+	else if (argc == 4)
 	{
-		char *metaBlock = new char[1024];
+		if (icompare(code, "-find"))
+		{
+			Index index;
+			string targetKey;
 
-		metadata.root = 1024;
-		metadata.level++;
+			fileOneName = argv[2];
+			targetKey = argv[3];
 
-		memcpy(&metaBlock[0], metadata.fileName, 256);
-		memcpy(&metaBlock[256], (char*)&metadata.keyLength, 8);
-		memcpy(&metaBlock[264], (char*)&metadata.root, 8);
-		memcpy(&metaBlock[272], (char*)&metadata.maxNode, 8);
-		memcpy(&metaBlock[280], (char*)&metadata.level, 8);
+			if (access(fileOneName.c_str(), F_OK) == -1 || !index.open(fileOneName, indexOptionsFromSwitches()))
+			{
+				cout << endl;
+				cout << "Error: Unable to locate file. Please enter valid file name..." << endl;
+				cout << endl;
+				return 0;
+			}
 
-		output.seekp(0, ios::beg);
-		output.write(metaBlock, 1024);
+			cout << endl;
+			findRecordUsingIndex(index, targetKey);
+			reportCorruptBlocks(index);
+			cout << endl;
 
-		delete[] metaBlock;
+			return 0;
+		}
+		if (icompare(code, "-findbatch"))
+		{
+			Index index;
+			ifstream keyFile;
+			vector<string> targetKeys;
 
-		char *block1 = new char[1024];
+			fileOneName = argv[2];
 
-		//Write the block1 to file
-		memcpy(&block1[0], data->key, metadata.keyLength);
-		memcpy(&block1[metadata.keyLength], (char*)&data->offset, 8);
-		memcpy(&block1[metadata.keyLength + 8], nullKey, metadata.keyLength);
-		memcpy(&block1[2*metadata.keyLength + 8], (char*)&nullOffset, 8);
+			keyFile.open(argv[3], ios::in | ios::binary);
+			if (access(fileOneName.c_str(), F_OK) == -1 || access(argv[3], F_OK) == -1 || !index.open(fileOneName, indexOptionsFromSwitches()))
+			{
+				cout << endl;
+				cout << "Error: Unable to locate file. Please enter valid file name..." << endl;
+				cout << endl;
+				return 0;
+			}
 
-		output.seekp(1024, ios::beg);
-		output.write(block1, 1024);
+			while (getline(keyFile, line))
+			{
+				if (!line.empty() && line[line.length() - 1] == '\r')
+					line.erase(line.length() - 1);
+				if (!line.empty())
+					targetKeys.push_back(line);
+			}
 
-		delete[] block1;
-	}
-	else if(metadata.root > 0)
-	{
-		//Conduct B+ Tree search and insert
+			cout << endl;
+			findRecordsBatched(index, targetKeys);
+			reportCorruptBlocks(index);
+			cout << endl;
 
-		//Recursive find the leaf node block. Returns the byte pointer to the leaf node block
-		size_t offsetPtr;
-		offsetPtr = searchBPTreeIndexOffset(metadata.root, output, data, metadata.level, 0, 1, 1);
+			return 0;
+		}
+		if (icompare(code, "-insert"))
+		{
+			Index index;
+			string record;
 
-		//Count the number of record in the leaf node block
-		size_t count = 0;
-		char *buffer = new char[1024];
-		char *keyBuff = new char[40];
-		char *checkNULL = new char[4];
-		size_t level = 0;
-		
-		output.seekg(0, ios::beg);
-		output.seekg(offsetPtr, ios::beg);		//Go to leaf node block
-		output.read(buffer, 1024);				// Write the eniter block to char array for modification
+			fileOneName = argv[2];
+			record = argv[3];
 
-		int pos = 0;
+			if (access(fileOneName.c_str(), F_OK) == -1 || !index.open(fileOneName, indexOptionsFromSwitches()))
+			{
+				cout << endl;
+				cout << "Error: Unable to locate file. Please enter valid file name..." << endl;
+				cout << endl;
+				return 0;
+			}
 
-		char *nullcmp = new char[4];
-		strncpy(&nullcmp[0], nullKey, 4);
+			cout << endl;
+			insertRecordUsingIndex(index, record);
+			cout << endl;
 
-		while (count <= metadata.maxNode)
+			return 0;
+		}
+		if (icompare(code, "-insertbatch"))
 		{
-			strncpy(keyBuff, buffer + pos, metadata.keyLength);
-			strncpy(checkNULL, keyBuff, 4);
+			Index index;
+			ifstream recordFile;
+			vector<string> records;
 
-			if(checkNULL[0] == nullcmp[0] && checkNULL[1] == nullcmp[1] && checkNULL[2] == nullcmp[2] && checkNULL[3] == nullcmp[3])
-				break;
-			else
-				count++;
-				
-			pos = pos + metadata.keyLength + 8;
-		}
+			fileOneName = argv[2];
 
-		delete[] keyBuff;
-		delete[] buffer;
+			recordFile.open(argv[3], ios::in | ios::binary);
+			if (access(fileOneName.c_str(), F_OK) == -1 || access(argv[3], F_OK) == -1 || !index.open(fileOneName, indexOptionsFromSwitches()))
+			{
+				cout << endl;
+				cout << "Error: Unable to locate file. Please enter valid file name..." << endl;
+				cout << endl;
+				return 0;
+			}
+
+			while (getline(recordFile, line))
+			{
+				if (!line.empty() && line[line.length() - 1] == '\r')
+					line.erase(line.length() - 1);
+				if (!line.empty())
+					records.push_back(line);
+			}
+
+			cout << endl;
+			insertRecordsBatched(index, records);
+			cout << endl;
 
-		insertRecord(offsetPtr, output, data, count, 1);
+			return 0;
+		}
+	}
+
+	else if (!icompare(code, "-create") && !icompare(code, "-list") && !icompare(code, "-find") && !icompare(code, "-findbatch") && !icompare(code, "-bench") && !icompare(code, "-insert") && !icompare(code, "-insertbatch") && !icompare(code, "-rebuild") && !icompare(code, "-flush") && !icompare(code, "-refresh") && !icompare(code, "-count") && !icompare(code, "-keys") && !icompare(code, "-verify") && !icompare(code, "-serve"))
+	{
+		cout << endl;
+		cout << "Error: Invalid code. Valid codes are -c or -l. Please enter a valid code..." << endl;
+		cout << endl;
+		return 0;
 	}
-	
 }
 
 /**************************************************************************
-* Function to search for the correct offset pointer in the B+ Tree Index
+* Function to list records, starting from the first key not less than
+* startingKey
 **************************************************************************/
-size_t searchBPTreeIndexOffset(size_t offsetPtr, fstream &output, Record *data, size_t level, size_t count, size_t levelCount, size_t option)
+size_t listRecordUsingIndex(Index &index, string startingKey, size_t count)
 {
-	size_t target = 0;
-	output.seekg(offsetPtr, ios::beg);
+	size_t traverseCount = 0;
+	RangeIterator it = index.range(startingKey, count);
 
-	if (option == 1)	
-		target = level;				//Find the target leaf node
-	else if (option == 2)
-		target = level - 1;			//Find the target internal node
+	string key = startingKey.substr(0, index.keyLength());
 
-	if (levelCount < target)		//if block is an internal node
-	{
-		//Get key to compare
-		char *keyBuff = new char[40];
-		char *cmpNULL = new char[4];
+	if (it.valid() && it.keyString() == key)
+		cout << "Entry found. Displaying " << count << " records starting with entry, or up to the last record in the list:" << endl << endl;
+	else
+		cout << "Entry not found. Displaying the next " << count << " records greater than entry, or up to the last record in the list:" << endl << endl;
 
-		//Read in a key
-		output.seekg(offsetPtr+8, ios::beg);		//internal node starts with an 8 byte key
-		output.read(keyBuff, metadata.keyLength);
-		memcpy(&cmpNULL[0], keyBuff, metadata.keyLength);
+	//Index only listings read nothing but the leaves
+	bool indexOnly = options.count("index-only") > 0;
 
-		//Compare keys
-		if ((keyBuff[0] == nullcmp[0] && keyBuff[1] == nullcmp[1] && keyBuff[2] == nullcmp[2] && keyBuff[3] == nullcmp[3]) || strcmp(data->key, keyBuff) < 0)
+	for (; it.valid(); it.next())
+	{
+		if (indexOnly)
 		{
-			output.seekg(offsetPtr, ios::beg);		//read the left offset
-			output.read((char*)&offsetPtr, 8);		
-			levelCount++;							//next level in the tree
-			count = 0;								//reset count
-			
-			delete[] keyBuff;
-			delete[] cmpNULL;
-			
-			return searchBPTreeIndexOffset(offsetPtr, output, data, level, count, levelCount, option);
+			cout.write(it.key(), strnlen(it.key(), index.keyLength()));
+			if (it.buffered())
+				cout << " in the write buffer\n";
+			else
+				cout << " at " << it.offset() << '\n';
+			traverseCount++;
+			continue;
 		}
-		else if (strcmp(data->key, keyBuff) > 0)
-		{
-			if(count < metadata.maxNode)	//stay in same level and return the next key
-			{
-				offsetPtr = offsetPtr + metadata.keyLength + 8;
-				count++;
-				
-				delete[] keyBuff;
-				delete[] cmpNULL;
-				return searchBPTreeIndexOffset(offsetPtr, output, data, level, count, levelCount, option);
-			}
-			else if (count == metadata.maxNode) //Will probably never happen?
-			{
-				offsetPtr = offsetPtr + metadata.keyLength + 8;
-				levelCount++;								//next level in the tree
-				count = 0;								//reset count
 
-				delete[] keyBuff;
-				delete[] cmpNULL;
-				return searchBPTreeIndexOffset(offsetPtr, output, data, level, count, levelCount, option);
-			}
-		}
+		RecordView view;
+		bool readable = it.record(view);
+
+		printRecordView(readable, view.data, view.length);
+		traverseCount++;
 	}
 
-	return offsetPtr;
+	return traverseCount;
 }
 
 /**************************************************************************
-* Function to insert records into B+ Tree index
+* Function to export records, starting from the first key not less than
+* startingKey, in the format of the writer. Records that cannot be read
+* are left out and counted on standard error.
 **************************************************************************/
-int insertRecord(size_t offsetPtr, fstream &output, Record *data, size_t count, size_t option)
+size_t exportRecordsUsingIndex(Index &index, string startingKey, size_t count, ExportWriter &writer)
 {
-	size_t offsetStart = 0;
-
-	if (option == 1 || option == 3)
-		offsetStart = 0;
-	else if (option == 2)
-		offsetStart = 8;
-
-	char *block1 = new char[1024];
-	char *keyBuff = new char[40];
-	char *checkNULL = new char[4];
-
-	output.seekg(offsetPtr, ios::beg);
-	output.read(block1, 1024);
+	size_t traverseCount = 0;
+	size_t unreadable = 0;
+	bool indexOnly = options.count("index-only") > 0;
 
-	size_t offsetPtr2;
-	output.seekg(offsetPtr + offsetStart + (metadata.keyLength + 8)*(count) + metadata.keyLength, ios::beg);		//Keep track of the pointer value to the next leaf or the NULL offset
-	output.read((char*)&offsetPtr2, 8);
-	pointerHolder = offsetPtr2;
+	writer.buffer.resize(EXPORT_BUFFER_SIZE);
 
-	int numRec = 0;
-	while (numRec <= count)
+	for (RangeIterator it = index.range(startingKey, count); it.valid() && !writer.failed; it.next())
 	{
+		const char *key = it.key();
+		size_t keyLength = strnlen(key, index.keyLength());
 
-		output.seekg(offsetPtr + offsetStart + (metadata.keyLength + 8)*numRec, ios::beg);		//Go to the next key in leaf node	
-		output.read(&keyBuff[0], metadata.keyLength);
-
-		memcpy(&checkNULL[0], keyBuff, metadata.keyLength);
-
-		string keyString(data->key);
-		string keyBuffString(keyBuff);
-
-		if ((checkNULL[0] == nullcmp[0] && checkNULL[1] == nullcmp[1] && checkNULL[2] == nullcmp[2] && checkNULL[3] == nullcmp[3]) || strcmp(data->key, keyBuff) < 0)		//If less than, insert into position and shift others to the right
+		//Index only exports stand the key in for the record
+		RecordView view;
+		if (indexOnly)
 		{
-
-			char *block2 = new char[1024];	//Used for holding shifting keys
-			output.seekg(offsetPtr + offsetStart + (metadata.keyLength + 8)*numRec, ios::beg);
-			output.read(block2, (metadata.keyLength + 8)*(count - numRec));	//Copy the keys to be shifted to the right, excluding NULL key
-
-			memcpy(&block1[offsetStart + (metadata.keyLength + 8)*numRec], data->key, metadata.keyLength); // write the key/offset to be inserted into the correct position
-			memcpy(&block1[offsetStart + (metadata.keyLength + 8)*numRec + metadata.keyLength], (char*)&data->offset, 8);
-
-			memcpy(&block1[offsetStart + (metadata.keyLength + 8)*numRec + metadata.keyLength + 8], block2, (metadata.keyLength + 8)*(count - numRec)); //Copy the shifted keys back into buffer block
-
-			delete[] block2;
-
-			if ((count + 1) < metadata.maxNode)	//If total # of nodes after insertion is still less than max capacity, add the NULL key and NULL offset
-			{
-				memcpy(&block1[offsetStart + (metadata.keyLength + 8)*(count + 1)], nullKey, metadata.keyLength);
-				memcpy(&block1[offsetStart + (metadata.keyLength + 8)*(count + 1) + metadata.keyLength], (char*)&offsetPtr2, 8);
-
-				//write block to file
-				output.seekg(offsetPtr, ios::beg);
-				output.write(block1, 1024);
-				delete[] block1;
-				return 0;
-			}
-			else if ((count + 1) == metadata.maxNode)
-			{
-				splitNode(block1, offsetPtr, output, data, count + 1, option);
-				return 0;
-			}
+			view.data = key;
+			view.length = keyLength;
 		}
-		else if (strcmp(data->key, keyBuff) > 0)		//If greater than, move to next pair
+		else if (!it.record(view))
 		{
-			if (numRec < count)		//If greater than but not reached NULL key, keep traversing
-			{
-				numRec++;
-				//offsetPtr = offsetPtr + metadata.keyLength + 8;
-			}
+			unreadable++;
+			continue;
 		}
-		else if (icompare(keyString, keyBuffString))
-			if (option == 3)
-			{
-				cout << endl;
-				cout << "A record with that key already exits." << endl;
-				cout << endl;
-				return 1;
-			}
-			else
-			{
-				cout << endl;
-				cout << "Duplicate Found." << endl;
-				cout << endl;
-				return 0;
-			}
+
+		exportRecord(writer, key, keyLength, it.buffered(), it.buffered() ? 0 : it.offset(), view.data, view.length);
+		traverseCount++;
 	}
+
+	if (unreadable > 0)
+		cerr << "Error: Unable to read " << unreadable << " records." << endl;
+
+	return traverseCount;
 }
 
 /**************************************************************************
-* Function to split node
+* Function to add one record to an export. raw writes the record and a
+* newline; tsv writes the key, the offset (empty for a record still in
+* the write buffer) and the record, with backslash, tab, carriage return
+* and newline escaped; binary writes a 4 byte little endian length and
+* the record.
 **************************************************************************/
-void splitNode(char block1[], size_t offsetPtr, fstream &output, Record *data, size_t count, size_t option)
+void exportRecord(ExportWriter &writer, const char *key, size_t keyLength, bool buffered, size_t offset, const char *data, size_t length)
 {
-	size_t offsetStart = 0;
-	if (option == 1)
-		offsetStart = 0;
-	else if (option == 2)
-		offsetStart = 8;
-
-	// CONDUCT NODE SPIT
-	char *splitBlock2 = new char[1024];		//used for holding the second half of block1
-	char *splitBlock3 = new char[1024];		//used for holding the internal nodes
-
-	/* Create a copy leaf block, block2 */
-	memcpy(&splitBlock2[0], &block1[offsetStart + (metadata.keyLength + 8)*((count + 1) / 2)], (metadata.keyLength + 8)*((count + 1) / 2));	//copy the last half of block 1 to block 2
-	memcpy(&splitBlock2[offsetStart + (metadata.keyLength + 8)*((count + 1) / 2)], nullKey, metadata.keyLength);								//add the null key to the end of block 2
-	memcpy(&splitBlock2[offsetStart + (metadata.keyLength + 8)*((count + 1) / 2) + metadata.keyLength], (char*)&pointerHolder, 8);				//add the null offset to the end of block 2
-
-	for (int i = (metadata.keyLength + 8)*((count + 1) / 2) + metadata.keyLength + 8; i < 1024; i++)
-		splitBlock2[i] = ' ';
-
-	output.seekg(0, ios::end);					//First two lines determines the length (offset pointer)
-	size_t offsetPtr2 = output.tellg(); 		
-	output.seekg(offsetPtr2, ios::beg);			//Seek to a offsetPtr2
-	output.write(splitBlock2, 1024);					//Append block2 to index
-
-	/* Modify block1*/
-	for (int i = (offsetStart + (metadata.keyLength + 8)*((count + 1) / 2)); i < 1024; i++)
-		block1[i] = ' ';	//Remove the last half of block 1
-
-	memcpy(&block1[offsetStart + (metadata.keyLength + 8)*((count + 1) / 2)], nullKey, metadata.keyLength);								//add the null key to the end of block 1
-	memcpy(&block1[offsetStart + (metadata.keyLength + 8)*((count + 1) / 2) + metadata.keyLength], (char*)&offsetPtr2, 8);				//add the offsetPtr2 to the end of block 1
-
-	output.seekg(offsetPtr, ios::beg);			//Seek to a offsetPtr
-	output.write(block1, 1024);					//Rewrite block1 to index
-
-	delete[] block1;
-
-	/* Create internal node block, Block3 */
-	if (metadata.level < 2)	//No internal node exist yet
+	if (icompare(writer.format, "binary"))
 	{
-		addNewNodeAfterSplit(splitBlock2, splitBlock3, output, offsetPtr, offsetPtr2);
+		uint32_t prefix = length;
+		exportAppend(writer, (const char*)&prefix, 4);
+		exportAppend(writer, data, length);
+		return;
 	}
 
-	else if (metadata.level >= 2)	//There exist an internal node
+	if (icompare(writer.format, "tsv"))
 	{
-		size_t offsetIntern = 0;
-		offsetIntern = searchBPTreeIndexOffset(metadata.root, output, data, metadata.level, 0, 1, 2);
-
-		//Count the number of record in the internal node block
-		size_t count = 0;
-		char *buffer = new char[1024];
-		char *keyBuff = new char[40];
-		char *checkNULL = new char[4];
-		size_t level = 0;
-
-		output.seekg(0, ios::beg);
-		output.seekg(offsetIntern, ios::beg);		//Go to internal node block
-		output.read(buffer, 1024);					// Write the entire block to char array for modification
+		char number[24];
+		int numberLength = buffered ? 0 : snprintf(number, sizeof(number), "%zu", offset);
 
-		int pos = 8;
+		exportAppend(writer, key, keyLength);
+		exportAppend(writer, "\t", 1);
+		exportAppend(writer, number, numberLength);
+		exportAppend(writer, "\t", 1);
 
-		char *nullcmp = new char[4];
-		strncpy(&nullcmp[0], nullKey, 4);
-
-		while (count <= metadata.maxNode)
+		//Runs of ordinary bytes go in whole; the four special ones are escaped
+		size_t start = 0;
+		for (size_t i = 0; i < length; i++)
 		{
-			strncpy(keyBuff, buffer + pos, metadata.keyLength);
-			strncpy(checkNULL, keyBuff, 4);
-
-			if (keyBuff[0] == nullcmp[0] && keyBuff[1] == nullcmp[1] && keyBuff[2] == nullcmp[2] && keyBuff[3] == nullcmp[3])
-				break;
-			else
-				count++;
+			const char *escape = data[i] == '\\' ? "\\\\" : data[i] == '\t' ? "\\t" : data[i] == '\r' ? "\\r" : data[i] == '\n' ? "\\n" : NULL;
+			if (escape == NULL)
+				continue;
 
-			pos = pos + metadata.keyLength + 8;
+			exportAppend(writer, data + start, i - start);
+			exportAppend(writer, escape, 2);
+			start = i + 1;
 		}
-		
-		delete[] keyBuff;
-		delete[] buffer;
-
-		Record *internalData = new Record;
-		memcpy(&internalData->key[0], &splitBlock2[0], metadata.keyLength);
-		internalData->offset = offsetPtr2;
-		
-		insertRecord(offsetIntern, output, internalData, count, 2);
-		
-		//delete[] internalData;
+		exportAppend(writer, data + start, length - start);
+		exportAppend(writer, "\n", 1);
+		return;
 	}
+
+	exportAppend(writer, data, length);
+	exportAppend(writer, "\n", 1);
 }
 
 /**************************************************************************
-* Function to add a new node to B+ tree index
+* Function to add bytes to an export, writing the buffer out when full
 **************************************************************************/
-void addNewNodeAfterSplit(char splitBlock2[], char splitBlock3[], fstream &output, size_t offsetPtr, size_t offsetPtr2)
+void exportAppend(ExportWriter &writer, const char *data, size_t length)
 {
+	while (length > 0 && !writer.failed)
+	{
+		if (writer.used == writer.buffer.size())
+			exportFlush(writer);
 
-	memcpy(&splitBlock3[0], (char*)&offsetPtr, 8);											//Copy the pointer to the left leaf node
-	memcpy(&splitBlock3[8], &splitBlock2[0], metadata.keyLength);							//Copy the first key from the right leaf node
-	memcpy(&splitBlock3[8 + metadata.keyLength], (char*)&offsetPtr2, 8);					//Copy the pointer to the right leaf node
-	memcpy(&splitBlock3[metadata.keyLength + 8 * 2], nullKey, metadata.keyLength);			//add the null key to the end of block 3
-	memcpy(&splitBlock3[metadata.keyLength * 2 + 8 * 2], (char*)&nullOffset, 8);				//add the null offset to the end of block 3
-
-	delete[] splitBlock2;
-
-	output.seekg(0, ios::end);					//First two lines determines the length (offset pointer)
-	size_t offsetIntern = output.tellg();
-	output.seekg(offsetIntern, ios::beg);			//Seek to a offsetIntern
-	output.write(splitBlock3, 1024);					//Append block3 to index
-
-	delete[] splitBlock3;
-
-	//update metadata block for the root
-	char *metaBlock = new char[1024];
-	metadata.root = offsetIntern;
-	metadata.level = metadata.level + 1;
-	strcpy(&metaBlock[0], metadata.fileName);
-	memcpy(&metaBlock[256], (char*)&metadata.keyLength, 8);
-	memcpy(&metaBlock[264], (char*)&metadata.root, 8);
-	memcpy(&metaBlock[272], (char*)&metadata.maxNode, 8);
-	memcpy(&metaBlock[280], (char*)&metadata.level, 8);
-
-	output.seekg(0, ios::beg);
-	output.write(metaBlock, 1024);
+		size_t part = min(length, writer.buffer.size() - writer.used);
+		memcpy(&writer.buffer[writer.used], data, part);
 
-	delete[] metaBlock;
+		writer.used = writer.used + part;
+		data = data + part;
+		length = length - part;
+	}
 }
 
 /**************************************************************************
-* Function to list records
+* Function to write out what an export has buffered. Returns false if a
+* write has failed.
 **************************************************************************/
-size_t listRecordUsingIndex(size_t offsetPtr, fstream& indexFile, string startingKey, size_t count)
+bool exportFlush(ExportWriter &writer)
 {
-	/* Get Metadata information */
-	ifstream recordFile;
-	size_t stringSize;
+	size_t done = 0;
 
-	size_t fileNameSize = 0;
-
-	for (int i = 0; i < 256; i++)			//Get length of file name
+	while (done < writer.used && !writer.failed)
 	{
-		if (metadata.fileName[i] != '.')
-			fileNameSize++;
+		ssize_t result = write(writer.fd, &writer.buffer[done], writer.used - done);
+		if (result < 0 && errno == EINTR)
+			continue;
+
+		if (result <= 0)
+			writer.failed = true;
+		else
+			done = done + result;
 	}
 
-	string recordFileName(metadata.fileName, fileNameSize+1);
-	char *keyBuff = new char[40];
-
-	Record *entry = new Record;
-
-	strncpy(&entry->key[0], startingKey.c_str(), metadata.keyLength);
-
-
-	strncpy(entry->key, startingKey.c_str(), sizeof(stringSize));
-
-	recordFile.open(recordFileName.c_str(), ios::in | ios::binary);
-
-	//Search for the leaf node that the entry should be in
-	offsetPtr = searchBPTreeIndexOffset(metadata.root, indexFile, entry, metadata.level, 0, 1, 1);
-
-	char *checkNULL = new char[40];
+	writer.used = 0;
+	return !writer.failed;
+}
 
-	size_t stopCount = 0;
+/**************************************************************************
+* Function to list the keys from startKey up to and including endKey
+**************************************************************************/
+size_t listKeysUsingIndex(Index &index, string startKey, string endKey)
+{
 	size_t traverseCount = 0;
-	size_t offset;
+	string lastKey = endKey.substr(0, index.keyLength());
 
-	int numRec = 0;
-	while (stopCount != 1)
+	for (RangeIterator it = index.range(startKey, (size_t)-1); it.valid(); it.next())
 	{
+		string key = it.keyString();
+		key = key.substr(0, strnlen(key.c_str(), key.length()));
 
-		indexFile.seekg(offsetPtr + (metadata.keyLength + 8)*numRec, ios::beg);		//Go to the next key in leaf node	
-		indexFile.read(&keyBuff[0], metadata.keyLength);
-
-		memcpy(&checkNULL[0], keyBuff, metadata.keyLength);
+		if (key.compare(lastKey) > 0)
+			break;
 
-		string keyString(entry->key);
-		string keyBuffString(keyBuff);
+		cout << key << '\n';
+		traverseCount++;
+	}
 
-		if ((strcmp(keyString.c_str(), keyBuffString.c_str()) < 0))		//If less than, insert into position and shift others to the right
-		{
-			cout << "Entry not found. Displaying the next " << count << " records greater than entry, or up to the last record in the list:" << endl << endl;
-			while (traverseCount < count)		//Print the next 10 keys
-			{
-				indexFile.seekg(offsetPtr + (8 + metadata.keyLength)*numRec, ios::beg);
-				indexFile.read(&checkNULL[0], metadata.keyLength);
+	return traverseCount;
+}
 
-				indexFile.seekg(offsetPtr + metadata.keyLength + (8 + metadata.keyLength)*numRec, ios::beg);
-				indexFile.read((char*)&offset, 8);
+/**************************************************************************
+* Function to find a specific record
+**************************************************************************/
+size_t findRecordUsingIndex(Index &index, string targetKey)
+{
+	FindResult result;
 
-				if (checkNULL[0] == nullcmp[0] && checkNULL[1] == nullcmp[1] && checkNULL[2] == nullcmp[2] && checkNULL[3] == nullcmp[3] && offset != 0)
-				{
-					offsetPtr = offset;
+	if (!index.find(targetKey, result))
+	{
+		cout << "Could not find record." << endl;
+		return 0;
+	}
 
-					indexFile.seekg(offsetPtr, ios::beg);
-					indexFile.read(&checkNULL[0], metadata.keyLength);
+	if (result.buffered)
+		cout << "In the write buffer, record: ";
+	else
+		cout << "At " << result.offset << ", record: ";
+	printRecordView(result.readable, result.record.data(), result.record.length());
 
-					indexFile.seekg(offsetPtr + metadata.keyLength, ios::beg);
-					indexFile.read((char*)&offset, 8);
+	return 1;
+}
 
-					numRec = 0;
-				}
-				else if (checkNULL[0] == nullcmp[0] && checkNULL[1] == nullcmp[1] && checkNULL[2] == nullcmp[2] && checkNULL[3] == nullcmp[3] && offset == 0)
-					break;
+/**************************************************************************
+* Function to insert a record
+**************************************************************************/
+void insertRecordUsingIndex(Index &index, string record)
+{
+	int result = index.insert(record);
+
+	if (result == INSERT_FAILED)
+		cout << "Error: " << index.lastError() << endl;
+	else if (result == INSERT_DUPLICATE)
+		cout << "A record with that key already exits." << endl;
+	else
+		cout << "Record successfully inserted." << endl;
+}
 
-				string recLine;
-				recordFile.seekg(offset, ios::beg);
-				getline(recordFile, recLine);
-				cout << recLine << endl;
-				traverseCount++;
-				numRec++;
-			}
-			stopCount = 1;
-		}
+/**************************************************************************
+* Function to find a batch of records
+**************************************************************************/
+void findRecordsBatched(Index &index, vector<string> &targetKeys)
+{
+	vector<FindResult> results;
+	index.findBatch(targetKeys, results);
 
-		if ((strcmp(keyString.c_str(), keyBuffString.c_str()) > 0))		//Move to the next record in the same node
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		if (!results[i].found)
 		{
-			numRec++;
+			cout << "Could not find record: " << targetKeys[i] << endl;
+			continue;
 		}
-		if (((strcmp(keyString.c_str(), keyBuffString.c_str()) == 0)))		//If reaches NULL of a leaf
-		{
-			cout << "Entry found. Displaying " << count << " records starting with entry, or up to the last record in the list:" << endl << endl;
-			while (traverseCount < count)		//Print the next 10 keys
-			{
-				indexFile.seekg(offsetPtr + (8 + metadata.keyLength)*numRec, ios::beg);
-				indexFile.read(&checkNULL[0], metadata.keyLength);
-
-				indexFile.seekg(offsetPtr + metadata.keyLength + (8 + metadata.keyLength)*numRec, ios::beg);
-				indexFile.read((char*)&offset, 8);
-
-				if (checkNULL[0] == nullcmp[0] && checkNULL[1] == nullcmp[1] && checkNULL[2] == nullcmp[2] && checkNULL[3] == nullcmp[3] && offset != 0)
-				{
-					offsetPtr = offset;
 
-					indexFile.seekg(offsetPtr, ios::beg);
-					indexFile.read(&checkNULL[0], metadata.keyLength);
-
-					indexFile.seekg(offsetPtr + metadata.keyLength, ios::beg);
-					indexFile.read((char*)&offset, 8);
-
-					numRec = 0;
-				}
-				else if (checkNULL[0] == nullcmp[0] && checkNULL[1] == nullcmp[1] && checkNULL[2] == nullcmp[2] && checkNULL[3] == nullcmp[3] && offset == 0)
-					break;
-
-				string recLine;
-				recordFile.seekg(offset, ios::beg);
-				getline(recordFile, recLine);
-				cout << recLine << endl;
-				traverseCount++;
-				numRec++;
-			}
-			stopCount = 1;
-		}
+		if (results[i].buffered)
+			cout << "In the write buffer, record: ";
+		else
+			cout << "At " << results[i].offset << ", record: ";
+		printRecordView(results[i].readable, results[i].record.data(), results[i].record.length());
 	}
 }
 
 /**************************************************************************
-* Function to find a specific record
+* Function to insert a batch of records
 **************************************************************************/
-size_t findRecordUsingIndex(size_t searchPtr, fstream& indexFile, string startingKey)
+void insertRecordsBatched(Index &index, vector<string> &records)
 {
-	/* Get Metadata information */
-	ifstream recordFile;
-	size_t stringSize;
+	vector<int> results;
+	index.insertBatch(records, results);
 
-	size_t fileNameSize = 0;
+	size_t inserted = 0;
+	size_t duplicates = 0;
 
-	for (int i = 0; i < 256; i++)			//Get length of file name
+	for (size_t i = 0; i < results.size(); i++)
 	{
-		if (metadata.fileName[i] != '.')
-			fileNameSize++;
+		if (results[i] == INSERT_DONE)
+			inserted++;
+		else if (results[i] == INSERT_DUPLICATE)
+		{
+			duplicates++;
+			cout << "A record with that key already exits: " << records[i] << endl;
+		}
+		else
+			cout << "Error: " << index.lastError() << " " << records[i] << endl;
 	}
 
-	string recordFileName(metadata.fileName, fileNameSize + 1);
-	char *keyBuff = new char[40];
+	cout << inserted << " records successfully inserted, " << duplicates << " duplicates." << endl;
+}
 
-	Record *entry = new Record;
+/**************************************************************************
+* Function to benchmark lookups against a mapped index. Keys are sampled
+* from the leaves, shuffled, and looked up sequentially and then
+* interleaved with growing group sizes.
+**************************************************************************/
+void benchmarkLookups(Index &index, string fileName, size_t numLookups)
+{
+	//Collect every key by walking the leaves from the leftmost one
+	vector<string> keys;
 
-	strncpy(&entry->key[0], startingKey.c_str(), metadata.keyLength);
+	for (RangeIterator it = index.range("", (size_t)-1); it.valid(); it.next())
+		keys.push_back(it.keyString());
 
+	if (keys.empty())
+	{
+		cout << "Error: Index has no keys." << endl;
+		return;
+	}
 
-	strncpy(entry->key, startingKey.c_str(), sizeof(stringSize));
+	vector<string> sample(numLookups);
+	vector<Lookup> expected;
+	vector<Lookup> results;
+	mt19937 random(6360);
 
-	recordFile.open(recordFileName.c_str(), ios::in | ios::binary);
+	for (size_t i = 0; i < numLookups; i++)
+		sample[i] = keys[random() % keys.size()];
 
-	//Search for the leaf node that the entry should be in
-	searchPtr = searchBPTreeIndexOffset(metadata.root, indexFile, entry, metadata.level, 0, 1, 1);
+	//A sharded index counts the blocks of all its shards
+	struct stat fileStat;
+	size_t length = 0;
 
-	char *checkNULL = new char[40];
+	if (index.shardCount() == 0)
+		length = stat(fileName.c_str(), &fileStat) == 0 ? fileStat.st_size : 0;
 
-	size_t stopCount = 0;
-	size_t traverseCount = 0;
-	size_t offset;
+	for (size_t shard = 0; shard < index.shardCount(); shard++)
+		length = length + (stat(shardFileName(fileName, shard).c_str(), &fileStat) == 0 ? fileStat.st_size : 0);
 
-	int numRec = 0;
-	while (stopCount != 1)
+	//A first pass maps the index, so the timed passes do not pay for it
+	if (!index.lookupBatch(sample, expected, LOOKUP_MAPPED_SEQUENTIAL))
 	{
+		cout << "Error: " << index.lastError() << endl;
+		return;
+	}
 
-		indexFile.seekg(searchPtr + (metadata.keyLength + 8)*numRec, ios::beg);		//Go to the next key in leaf node	
-		indexFile.read(&keyBuff[0], metadata.keyLength);
-
-		memcpy(&checkNULL[0], keyBuff, metadata.keyLength);
-
-		string keyString(entry->key);
-		string keyBuffString(keyBuff);
-
-		if (checkNULL[0] == nullcmp[0] && checkNULL[1] == nullcmp[1] && checkNULL[2] == nullcmp[2] && checkNULL[3] == nullcmp[3])
-		{
-			searchPtr = offset;
+	cout << "Lookups: " << numLookups << " over " << keys.size() << " keys, " << length / 1024 << " blocks" << endl << endl;
 
-			indexFile.seekg(searchPtr, ios::beg);
-			indexFile.read(&checkNULL[0], metadata.keyLength);
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	index.lookupBatch(sample, results, LOOKUP_MAPPED_SEQUENTIAL);
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
 
-			indexFile.seekg(searchPtr + metadata.keyLength, ios::beg);
-			indexFile.read((char*)&offset, 8);
+	size_t found = 0;
+	for (size_t i = 0; i < numLookups; i++)
+		found = found + (results[i].found ? 1 : 0);
 
-			numRec = 0;
-		}
+	cout << "Sequential:            " << (size_t)(numLookups / seconds) << " lookups/sec (" << found << " found)" << endl;
 
-		if ((strcmp(keyString.c_str(), keyBuffString.c_str()) < 0))		//If less than, insert into position and shift others to the right
-		{
-			cout << "Could not find record." << endl;
-			stopCount = 1;
-		}
+	for (size_t groupSize = 1; groupSize <= 64; groupSize = groupSize * 2)
+	{
+		start = chrono::steady_clock::now();
+		index.lookupBatch(sample, results, LOOKUP_MAPPED_INTERLEAVED, groupSize);
+		seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+		size_t mismatches = 0;
+		for (size_t i = 0; i < numLookups; i++)
+			if (results[i].offset != expected[i].offset)
+				mismatches++;
+
+		cout << "Interleaved, group " << groupSize << ":" << string(groupSize < 10 ? 4 : 3, ' ') << (size_t)(numLookups / seconds) << " lookups/sec";
+		if (mismatches > 0)
+			cout << " (" << mismatches << " results differ from sequential)";
+		cout << endl;
+	}
+}
 
-		if ((strcmp(keyString.c_str(), keyBuffString.c_str()) > 0))		//Move to the next record in the same node
-		{
-			numRec++;
-		}
-		if (((strcmp(keyString.c_str(), keyBuffString.c_str()) == 0)))		//If reaches NULL of a leaf
-		{
-			indexFile.seekg(searchPtr + (8 + metadata.keyLength)*numRec, ios::beg);
-			indexFile.read(&checkNULL[0], metadata.keyLength);
+/**************************************************************************
+* Function to print a record, or the error for one that could not be read
+**************************************************************************/
+void printRecordView(bool readable, const char *data, size_t length)
+{
+	if (!readable)
+	{
+		cout << "Error: Unable to read record.\n";
+		return;
+	}
 
-			indexFile.seekg(searchPtr + metadata.keyLength + (8 + metadata.keyLength)*numRec, ios::beg);
-			indexFile.read((char*)&offset, 8);
+	//No flush per record; a long listing would otherwise make a write for every line
+	cout.write(data, length);
+	cout << '\n';
+}
 
-			cout << "At " << offset << ", record: ";
+/**************************************************************************
+* Function to report index blocks that failed their checksum while read
+**************************************************************************/
+void reportCorruptBlocks(Index &index)
+{
+	if (index.corruptBlockCount() > 0)
+		cout << "Error: " << index.corruptBlockCount() << " index block reads failed their checksum; results may be incomplete. Run -verify for details." << endl;
+}
 
-			string recLine;
-			recordFile.seekg(offset, ios::beg);
-			getline(recordFile, recLine);
-			cout << recLine << endl;
-			traverseCount++;
-			numRec++;
+/**************************************************************************
+* Function to print the hits and size of the record cache
+**************************************************************************/
+void printCacheStats(Index &index)
+{
+	CacheStats stats = index.cacheStats();
+	size_t finds = stats.hits + stats.misses;
 
-			stopCount = 1;
-		}
-	}
+	cout << "Cache: " << stats.hits << " hits, " << stats.misses << " misses";
+	if (finds > 0)
+		cout << " (" << stats.hits * 100 / finds << "% hit rate)";
+	cout << ", " << stats.entries << " records in " << stats.bytes / 1024 << " KB." << endl;
 }
 
 /**************************************************************************
-* Utility functions
+* Function to gather the library options given as switches
 **************************************************************************/
-bool icompare_pred(unsigned char a, unsigned char b)
+IndexOptions indexOptionsFromSwitches()
 {
-	return tolower(a) == tolower(b);
+	IndexOptions indexOptions;
+
+	indexOptions.bloom = options.count("bloom") > 0 || options.count("bloom-fpr") > 0;
+	indexOptions.bloomFalsePositiveRate = atof(getOption("bloom-fpr", "0.01").c_str());
+	indexOptions.ioDepth = atoi(getOption("io-depth", "32").c_str());
+	indexOptions.ioEngine = getOption("io-engine", "uring");
+	indexOptions.mmap = options.count("mmap") > 0;
+	indexOptions.groupSize = atoi(getOption("group-size", "8").c_str());
+	indexOptions.shards = atoi(getOption("shards", "1").c_str());
+	indexOptions.writeBuffer = atoi(getOption("write-buffer", "0").c_str());
+	indexOptions.compressLeaves = options.count("compress-leaves") > 0;
+	indexOptions.verifyChecksums = options.count("verify-checksums") > 0;
+	indexOptions.verifyThreads = atoi(getOption("verify-threads", "0").c_str());
+	indexOptions.cacheBytes = (size_t)atoi(getOption("cache-mb", "0").c_str()) * 1048576;
+
+	return indexOptions;
 }
 
-bool icompare(std::string const& a, std::string const& b)
+/**************************************************************************
+* Utility functions
+**************************************************************************/
+string getOption(string name, string defaultValue)
 {
-	if (a.length() == b.length()) {
-		return std::equal(b.begin(), b.end(),
-			a.begin(), icompare_pred);
-	}
-	else {
-		return false;
-	}
-}
\ No newline at end of file
+	map<string, string>::iterator it = options.find(name);
+
+	if (it == options.end() || it->second.empty())
+		return defaultValue;
+
+	return it->second;
+}
@@ -0,0 +1,5550 @@
+/******************************************************************************
+* B+ Tree Index Storage library
+*
+* The index engine behind the BPIndex program, for programs that want to
+* use an index in process instead of running the program once per query.
+* Everything is in this header; include it and compile with -std=c++11
+* -pthread. Nothing is printed and no state is shared between indexes.
+*
+*	bpindex::Index index;
+*
+*	if (!index.open("data.idx"))
+*		cerr << index.lastError() << endl;
+*
+*	bpindex::FindResult result;
+*	if (index.find("123456789012345", result))
+*		cout << result.record << endl;
+*
+*	for (bpindex::RangeIterator it = index.range("1", 10); it.valid(); it.next())
+*	{
+*		bpindex::RecordView view;
+*		if (it.record(view))
+*			cout.write(view.data, view.length) << endl;
+*	}
+*
+*	index.insert("123451234512345 new record");
+*
+* An open Index reads the snapshot of the tree that was current when it
+* was opened; refresh() moves it on to the latest one. insert() moves it
+* on to the snapshot holding the new record. Range iterators are not
+* valid past either call. An Index is not safe to use from several
+* threads at once; open one per thread.
+*
+* IndexOptions::shards splits a new index by key range into independent
+* B+ tree files. The other calls work on the whole index as usual, with
+* batches spread over the shards on threads of their own.
+*
+* IndexOptions::writeBuffer makes inserts go to a write-ahead log, which
+* readers merge with the tree, until that many records are buffered or
+* flush() is called; they then go into the tree as one sorted batch.
+* An insert returns once the log is on disk, and the log is only emptied
+* once the tree and the record file are.
+*
+* Every block of a new index ends with a CRC32C checksum. verify() checks
+* them and the structure of the tree; with IndexOptions::verifyChecksums
+* readers also check each block they read, and skip any that fail.
+*
+* IndexOptions::cacheBytes keeps the records of the keys found most often
+* in memory, where find() and findBatch() answer them without the tree;
+* cacheStats() tells how often that happened.
+*
+* The index remembers how much of its text file it has read. catchUp()
+* indexes the lines appended to the file since, reading only those. Only
+* whole lines are indexed, so a last line without its newline is left
+* until catchUp() finds it finished.
+*
+* find(), findBatch(), insert() and range iterators work in buffers the
+* Index keeps between calls, so once it is warmed up they do not allocate,
+* other than for records the write buffer takes in, for a cached record
+* longer than any its reused cache entry held before, and for the threads
+* a shard manifest runs batches on. A range iterator borrows
+* its buffers from the Index until it goes, so it must not outlive it.
+* tests/test_allocations.cpp checks this.
+******************************************************************************/
+
+#ifndef BPINDEX_H
+#define BPINDEX_H
+
+#include <map>
+#include <set>
+#include <list>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+#include <random>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/file.h>
+#include <signal.h>
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define BPINDEX_HAVE_IO_URING
+#endif
+
+//The crc32 instruction of SSE 4.2 is used when the processor running the program has it
+#if defined(__x86_64__) && defined(__GNUC__)
+#define BPINDEX_HAVE_SSE42_CRC32C
+#endif
+
+namespace bpindex
+{
+
+using namespace std;
+
+//Record file layouts. Text records are addressed by byte offset; binary
+//records live in 4096 byte slotted pages and are addressed by (page, slot)
+const size_t RECORD_FORMAT_TEXT = 0;
+const size_t RECORD_FORMAT_BINARY = 1;
+const size_t RECORD_FORMAT_COLUMNAR = 2;		//Binary, with the key left out of the record and read back from the index
+
+const size_t LEAF_FORMAT_PLAIN = 0;
+const size_t LEAF_FORMAT_COMPRESSED = 1;	//Front coded keys and delta coded offsets, up to four times the entries
+
+const size_t LEAF_BUFFER_SIZE = 4096;		//Room for a compressed leaf expanded to the plain layout
+
+const size_t BLOCK_CHECKSUM_OFFSET = 1020;	//Blocks of a checksummed index end with the CRC32C of the bytes before
+
+const size_t RECORD_PAGE_SIZE = 4096;
+const size_t RECORD_SLOT_BITS = 16;
+
+const size_t TEXT_RECORD_READ = 512;		//Bytes read for a text record; longer lines are finished with further reads
+
+const size_t READER_SLOTS = 1024;
+
+const size_t INSERT_RESERVE_LEVELS = 16;	//Tree height the buffers of an insert are sized for before it starts
+
+const size_t SHARD_SAMPLE_KEYS = 1024;		//Keys sampled per shard to pick the shard boundaries
+
+const size_t CACHE_ENTRY_OVERHEAD = 128;	//Bytes a record cache entry takes besides its key and record
+
+//Results of Index::insert()
+const int INSERT_DONE = 0;
+const int INSERT_DUPLICATE = 1;
+const int INSERT_FAILED = -1;
+
+//Ways Index::lookupBatch() can resolve its lookups
+const int LOOKUP_BY_LEVEL = 0;				//Read the index one level at a time with the asynchronous I/O engine
+const int LOOKUP_MAPPED_SEQUENTIAL = 1;		//In the memory mapped index, one lookup after another
+const int LOOKUP_MAPPED_INTERLEAVED = 2;	//In the memory mapped index, a group of lookups interleaved
+
+//The NULL key that ends every node, padded with '0' to the longest key
+const char nullKey[41] = "NULL000000000000000000000000000000000000";
+const char nullcmp[4] = { 'N','U','L','L' };
+
+const size_t nullOffset = 0;
+
+struct Metadata
+{
+	char fileName[256];
+	size_t keyLength = 0;
+	size_t root = 0;
+	size_t maxNode = 0;
+	size_t level = 0;
+	size_t recordFormat = 0;		//One of the RECORD_FORMAT_* values above
+	size_t epoch = 0;				//Version of the tree, moved on by each copy on write insert
+	size_t leafFormat = 0;			//One of the LEAF_FORMAT_* values above
+	size_t pageChecksums = 0;		//1 if every block ends with its checksum
+	size_t textLength = 0;			//Bytes of the text file indexed, up to the end of a whole line
+	char textFileName[256] = {};	//Text file the records came from; empty in indexes created before it was kept
+	char lowKey[41] = {};			//Keys of a shard are at least lowKey and below highKey;
+	char highKey[41] = {};			//empty for no bound, and in shards created before they were kept
+};
+
+struct NodeEntry
+{
+	char key[40];
+	size_t pointer;			//Record offset in a leaf, child to the right of the key in an internal node
+};
+
+struct FreePage
+{
+	size_t offset;
+	size_t epoch;			//First epoch whose tree no longer uses the page
+};
+
+struct TreeWriter
+{
+	bool copyOnWrite = false;
+	size_t fileEnd = 0;
+	vector<size_t> reusable;		//Retired pages that no pinned reader can reach
+	vector<FreePage> freePages;		//Retired pages some reader may still reach
+	vector<size_t> retired;			//Pages replaced by the current write
+	vector<size_t> fresh;			//Pages allocated by the current write, safe to change in place, in order
+	vector<pair<size_t, size_t> > dirty;	//Nodes changed by a copy on write, held until it commits:
+											//page and block in dirtyBlocks, in page order
+	vector<char> dirtyBlocks;		//1024 bytes for each changed node
+
+	//Kept from one write to the next, so that inserts reuse them rather than allocate
+	vector<NodeEntry> entries;
+	vector<NodeEntry> rightEntries;
+	vector<size_t> pathNodes;
+	vector<size_t> pathPositions;
+	vector<uint64_t> keyHashes;
+};
+
+struct ReaderSlot
+{
+	uint64_t pid;
+	uint64_t epoch;
+};
+
+struct ReaderPin
+{
+	int fd = -1;
+	size_t slot = READER_SLOTS;
+};
+
+struct BloomFilter
+{
+	bool loaded = false;
+	size_t numBlocks = 0;			//Number of 512 bit (one cache line) blocks
+	size_t numHashes = 0;			//Number of bits set per key inside its block
+	size_t numKeys = 0;
+	vector<uint64_t> bits;
+};
+
+struct RecordStore
+{
+	int writeFd = -1;				//Opened by the first insert, which appends to the record file
+	int fd = -1;
+	char *map = NULL;				//Read only mapping of the binary record file
+	size_t mapLength = 0;
+	char page[RECORD_PAGE_SIZE];	//Holds a page read past the end of the mapping
+};
+
+struct ReadRequest
+{
+	int fd;
+	size_t offset;
+	size_t length;
+	char *buffer;
+	ssize_t result;			//Bytes read, or -1 until the read finishes
+};
+
+struct AsyncIO
+{
+	bool initialized = false;
+	bool useRing = false;
+	size_t queueDepth = 32;		//Reads kept in flight at once
+
+	//io_uring submission and completion rings
+	int ringFd = -1;
+	unsigned sqEntries = 0;
+	unsigned *sqTail = NULL;
+	unsigned *sqMask = NULL;
+	unsigned *sqArray = NULL;
+	struct io_uring_sqe *sqes = NULL;
+	unsigned *cqHead = NULL;
+	unsigned *cqTail = NULL;
+	unsigned *cqMask = NULL;
+	struct io_uring_cqe *cqes = NULL;
+	void *sqMap = NULL;				//The three ring mappings, unmapped when the ring is released
+	size_t sqMapLength = 0;
+	void *cqMap = NULL;				//Same as sqMap when the kernel maps both rings at once
+	size_t cqMapLength = 0;
+	void *sqesMap = NULL;
+	size_t sqesMapLength = 0;
+
+	//pread thread pool, used when io_uring is not available
+	vector<thread> workers;
+	mutex lock;
+	condition_variable workReady;
+	condition_variable workDone;
+	vector<ReadRequest> *batch = NULL;
+	size_t nextRequest = 0;
+	size_t pending = 0;
+	bool stopping = false;
+};
+
+struct CacheEntry
+{
+	string key;
+	size_t offset;
+	string record;
+	size_t bytes;					//Memory the entry is charged for
+	bool protectedEntry;			//In the protected segment, having been hit since it was added
+};
+
+struct CacheSlot
+{
+	bool used = false;
+	uint64_t hash = 0;
+	list<CacheEntry>::iterator entry;
+};
+
+struct RecordCache
+{
+	size_t capacity = 0;			//Bytes the entries may take; 0 when there is no cache
+	size_t bytes = 0;
+	size_t protectedBytes = 0;
+	list<CacheEntry> probation;		//Entries not hit since they were added, most recent first
+	list<CacheEntry> protectedList;	//Entries hit since, most recent first
+	list<CacheEntry> spare;			//Entries evicted or erased, kept with their strings for the next ones added
+	vector<CacheSlot> slots;		//The entries by key hash, open addressed with linear probing
+	size_t entries = 0;
+	size_t hits = 0;
+	size_t misses = 0;
+};
+
+struct TextLines
+{
+	vector<char> keys;				//keyLength bytes for each whole line of a text file, in file order
+	vector<size_t> offsets;			//Where each line starts, then where the last one ends
+	int fd = -1;					//The text file, for reading lines back with pread
+};
+
+struct LeafCursor
+{
+	vector<size_t> positions;		//Child followed in each internal node on the path, root first
+	vector<char> blocks;			//The internal node blocks on the path
+};
+
+struct BatchLookup
+{
+	char key[41];
+	size_t node;			//Next node block to visit
+	size_t levelCount;		//Level of that node, the root being 1
+	bool active;
+	bool found;
+	size_t offset;			//Record offset once found
+};
+
+struct IndexOptions
+{
+	size_t recordFormat = RECORD_FORMAT_TEXT;		//Record file layout written by create()
+	bool bloom = false;								//Also build a Bloom filter sidecar in create()
+	double bloomFalsePositiveRate = 0.01;
+	size_t ioDepth = 32;							//Reads kept in flight at once
+	string ioEngine = "uring";						//uring, or threads for the pool of pread threads
+	bool mmap = false;								//findBatch() resolves lookups in the mapped index
+	size_t groupSize = 8;							//Lookups findBatch() interleaves with mmap
+	size_t shards = 1;								//Key range shards create() splits the index into
+	bool compressLeaves = false;					//create() and rebuild() write compressed leaves
+	bool verifyChecksums = false;					//Readers check the checksum of every index block they read
+	size_t verifyThreads = 0;						//Threads verify() checks the tree on; 0 for one per core
+	size_t cacheBytes = 0;							//Memory for records find() and findBatch() keep for the
+													//keys asked for most; split between the shards
+	size_t writeBuffer = 0;							//Records inserts hold in the write-ahead log before they
+													//are flushed into the tree; 0 inserts straight into the tree
+};
+
+struct RecordView
+{
+	const char *data = NULL;		//Whole record, key included; valid until the next call on its iterator
+	size_t length = 0;
+};
+
+struct Lookup
+{
+	bool found = false;
+	size_t offset = 0;		//Record offset, if found
+	bool buffered = false;	//Found in the write buffer, so it has no offset yet
+};
+
+struct FindResult
+{
+	bool found = false;
+	size_t offset = 0;
+	bool readable = false;		//False if the key is in the index but its record could not be read
+	bool buffered = false;		//Found in the write buffer, so it has no offset yet
+	string record;
+};
+
+struct CacheStats
+{
+	size_t hits = 0;				//Finds answered from the record cache
+	size_t misses = 0;				//Finds that went to the tree
+	size_t entries = 0;
+	size_t bytes = 0;
+};
+
+struct VerifyNode
+{
+	size_t page;
+	string lowKey;					//Keys of the node must be at least lowKey and below highKey;
+	string highKey;					//empty for no bound
+};
+
+struct VerifyResult
+{
+	size_t blocks = 0;				//Index blocks checked
+	size_t keys = 0;				//Leaf entries checked
+	vector<string> problems;		//One line for each problem found; empty if the index is sound
+};
+
+/**************************************************************************
+* Function to hash a key for the Bloom filter. Only the first keyLength
+* bytes (or up to the terminating null) take part in the hash.
+**************************************************************************/
+inline uint64_t hashKey(const char *key, size_t keyLength)
+{
+	uint64_t hash = 14695981039346656037ULL;		//FNV-1a
+
+	for (size_t i = 0; i < keyLength && key[i] != '\0'; i++)
+	{
+		hash ^= (unsigned char)key[i];
+		hash *= 1099511628211ULL;
+	}
+
+	//Finalize so keys that differ only in their trailing bytes still spread across blocks
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	hash *= 0xc4ceb9fe1a85ec53ULL;
+	hash ^= hash >> 33;
+
+	return hash;
+}
+
+/**************************************************************************
+* Function to start an empty record page. A page begins with the slot count
+* and the start of the record area (both 2 bytes), followed by a 2 byte slot
+* directory. Records are packed from the end of the page towards the front,
+* each as a 2 byte length followed by the record bytes.
+**************************************************************************/
+inline void initRecordPage(char page[])
+{
+	uint16_t numSlots = 0;
+	uint16_t recordStart = RECORD_PAGE_SIZE;
+
+	memset(page, 0, RECORD_PAGE_SIZE);
+	memcpy(&page[0], (char*)&numSlots, 2);
+	memcpy(&page[2], (char*)&recordStart, 2);
+}
+
+/**************************************************************************
+* Function to add a record to a page. Returns false if the page is full
+**************************************************************************/
+inline bool addRecordToPage(char page[], const char *data, size_t length, size_t &slot)
+{
+	uint16_t numSlots;
+	uint16_t recordStart;
+
+	memcpy((char*)&numSlots, &page[0], 2);
+	memcpy((char*)&recordStart, &page[2], 2);
+
+	size_t directoryEnd = 4 + 2 * (numSlots + 1);
+	if (recordStart < directoryEnd || recordStart - directoryEnd < length + 2)
+		return false;
+
+	uint16_t recordLength = length;
+	recordStart = recordStart - length - 2;
+
+	memcpy(&page[recordStart], (char*)&recordLength, 2);
+	memcpy(&page[recordStart + 2], data, length);
+	memcpy(&page[4 + 2 * numSlots], (char*)&recordStart, 2);
+
+	slot = numSlots;
+	numSlots++;
+
+	memcpy(&page[0], (char*)&numSlots, 2);
+	memcpy(&page[2], (char*)&recordStart, 2);
+
+	return true;
+}
+
+/**************************************************************************
+* Function to locate a record inside a record page by its slot
+**************************************************************************/
+inline bool recordInPage(const char page[], size_t slot, const char *&data, size_t &length)
+{
+	uint16_t numSlots;
+	uint16_t recordStart;
+	uint16_t recordLength;
+
+	memcpy((char*)&numSlots, &page[0], 2);
+	if (slot >= numSlots)
+		return false;
+
+	memcpy((char*)&recordStart, &page[4 + 2 * slot], 2);
+	if ((size_t)recordStart + 2 > RECORD_PAGE_SIZE)
+		return false;
+
+	memcpy((char*)&recordLength, &page[recordStart], 2);
+	if ((size_t)recordStart + 2 + recordLength > RECORD_PAGE_SIZE)
+		return false;
+
+	data = &page[recordStart + 2];
+	length = recordLength;
+
+	return true;
+}
+
+/**************************************************************************
+* Function to check for the NULL key that ends a node
+**************************************************************************/
+inline bool isNullKey(const char *key)
+{
+	return key[0] == nullcmp[0] && key[1] == nullcmp[1] && key[2] == nullcmp[2] && key[3] == nullcmp[3];
+}
+
+/**************************************************************************
+* Tables for computing CRC32C eight bytes at a time without the crc32
+* instruction
+**************************************************************************/
+struct Crc32cTables
+{
+	uint32_t table[8][256];
+
+	Crc32cTables()
+	{
+		for (uint32_t n = 0; n < 256; n++)
+		{
+			uint32_t crc = n;
+			for (int bit = 0; bit < 8; bit++)
+				crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+			table[0][n] = crc;
+		}
+
+		for (uint32_t n = 0; n < 256; n++)
+			for (int slice = 1; slice < 8; slice++)
+				table[slice][n] = (table[slice - 1][n] >> 8) ^ table[0][table[slice - 1][n] & 0xff];
+	}
+};
+
+inline uint32_t crc32cSoftware(uint32_t crc, const char *data, size_t length)
+{
+	static const Crc32cTables tables;
+	const uint32_t (*t)[256] = tables.table;
+	const unsigned char *bytes = (const unsigned char*)data;
+
+	while (length >= 8)
+	{
+		uint32_t low;
+		uint32_t high;
+		memcpy(&low, bytes, 4);
+		memcpy(&high, bytes + 4, 4);
+		low = low ^ crc;
+
+		crc = t[7][low & 0xff] ^ t[6][(low >> 8) & 0xff] ^ t[5][(low >> 16) & 0xff] ^ t[4][low >> 24] ^
+			t[3][high & 0xff] ^ t[2][(high >> 8) & 0xff] ^ t[1][(high >> 16) & 0xff] ^ t[0][high >> 24];
+
+		bytes = bytes + 8;
+		length = length - 8;
+	}
+
+	for (; length > 0; length--)
+		crc = (crc >> 8) ^ t[0][(crc ^ *bytes++) & 0xff];
+
+	return crc;
+}
+
+#ifdef BPINDEX_HAVE_SSE42_CRC32C
+__attribute__((target("sse4.2"))) inline uint32_t crc32cHardware(uint32_t crc, const char *data, size_t length)
+{
+	uint64_t crc64 = crc;
+
+	while (length >= 8)
+	{
+		uint64_t word;
+		memcpy(&word, data, 8);
+		crc64 = __builtin_ia32_crc32di(crc64, word);
+
+		data = data + 8;
+		length = length - 8;
+	}
+
+	crc = (uint32_t)crc64;
+	for (; length > 0; length--)
+		crc = __builtin_ia32_crc32qi(crc, (unsigned char)*data++);
+
+	return crc;
+}
+#endif
+
+/**************************************************************************
+* Function to compute the CRC32C (Castagnoli) checksum of a buffer, with
+* the crc32 instruction where the processor has one
+**************************************************************************/
+inline uint32_t crc32c(const char *data, size_t length)
+{
+#ifdef BPINDEX_HAVE_SSE42_CRC32C
+	static const bool hardware = __builtin_cpu_supports("sse4.2");
+	if (hardware)
+		return ~crc32cHardware(0xFFFFFFFF, data, length);
+#endif
+
+	return ~crc32cSoftware(0xFFFFFFFF, data, length);
+}
+
+/**************************************************************************
+* Function to check the checksum at the end of an index block
+**************************************************************************/
+inline bool blockChecksumMatches(const char block[])
+{
+	uint32_t stored;
+	memcpy(&stored, &block[BLOCK_CHECKSUM_OFFSET], 4);
+
+	return stored == crc32c(block, BLOCK_CHECKSUM_OFFSET);
+}
+
+/**************************************************************************
+* Function to finish a read with pread. Stops early only at end of file
+**************************************************************************/
+inline void completeRead(ReadRequest &request, size_t done)
+{
+	while (done < request.length)
+	{
+		ssize_t result = pread(request.fd, request.buffer + done, request.length - done, request.offset + done);
+		if (result < 0 && errno == EINTR)
+			continue;
+		if (result <= 0)
+			break;
+
+		done = done + result;
+	}
+
+	request.result = done;
+}
+
+/**************************************************************************
+* Function to prefetch the start of a node block into the cache. Node
+* scans run forward from the front of the block, so the hardware
+* prefetcher picks up the rest.
+**************************************************************************/
+inline void prefetchNode(const char *base, size_t length, size_t node)
+{
+	if (node + 1024 > length)
+		return;
+
+	__builtin_prefetch(base + node);
+	__builtin_prefetch(base + node + 64);
+	__builtin_prefetch(base + node + 128);
+	__builtin_prefetch(base + node + 192);
+}
+
+/**************************************************************************
+* Utility functions
+**************************************************************************/
+inline bool icompare_pred(unsigned char a, unsigned char b)
+{
+	return tolower(a) == tolower(b);
+}
+
+inline bool icompare(std::string const& a, std::string const& b)
+{
+	if (a.length() == b.length()) {
+		return std::equal(b.begin(), b.end(),
+			a.begin(), icompare_pred);
+	}
+	else {
+		return false;
+	}
+}
+
+/**************************************************************************
+* Function to get the file name of a shard of a shard manifest
+**************************************************************************/
+inline string shardFileName(const string &manifestFileName, size_t shard)
+{
+	return manifestFileName + "." + to_string(shard);
+}
+
+class Index;
+
+/**************************************************************************
+* Forward iterator over the entries of an index in key order, from
+* Index::range(). Records are fetched only when asked for, a leaf's worth
+* at a time, so walking just the keys reads nothing but the index.
+* It can be moved but not copied, as only one iterator may hand its
+* buffers back to the Index.
+**************************************************************************/
+class RangeIterator
+{
+public:
+	RangeIterator() {}
+	RangeIterator(RangeIterator &&other);
+	~RangeIterator();
+
+	RangeIterator(const RangeIterator &) = delete;
+	RangeIterator &operator=(const RangeIterator &) = delete;
+
+	bool valid() const;
+	void next();
+	RangeIterator &operator++();
+	const char *key() const;		//keyLength bytes, not null terminated
+	string keyString() const;
+	size_t offset() const;
+	bool buffered() const { return fromBuffer; }		//In the write buffer, so without an offset
+	bool record(RecordView &view);
+
+private:
+	friend class Index;
+
+	void start(const char *key);
+	bool settleLeaf();
+	void settle();
+	void fetchRecords();
+	void swapBuffers();
+
+	Index *index = NULL;
+	Index *sharded = NULL;			//Shard manifest the range runs through, if any
+	Index *owner = NULL;			//Index the buffers below were taken from, and go back to
+	size_t shard = 0;
+	LeafCursor cursor;
+	char leaf[LEAF_BUFFER_SIZE];	//Current leaf, expanded to the plain layout
+	char nextLeaf[1024];
+	int nextState = 0;				//0: next leaf not looked for yet, 1: read into nextLeaf, 2: none
+	size_t numRec = 0;				//Current entry in leaf
+	size_t remaining = 0;			//Entries still to be visited, the current one included
+	size_t fetchFirst = 0;			//Entries [fetchFirst, fetchEnd) of leaf have their records read
+	size_t fetchEnd = 0;
+	vector<ReadRequest> requests;
+	vector<char> buffers;
+	string overflow;				//Records that do not fit their read buffer as is
+	map<string, string>::const_iterator pending;		//Next entry of the write buffer
+	map<string, string>::const_iterator pendingEnd;
+	bool fromBuffer = false;		//The current entry is pending, not leaf entry numRec
+};
+
+/**************************************************************************
+* A B+ tree index and its record file
+**************************************************************************/
+class Index
+{
+public:
+	Index() {}
+	~Index() { close(); }
+
+	Index(const Index &) = delete;
+	Index &operator=(const Index &) = delete;
+
+	bool create(const string &textFileName, const string &indexFileName, size_t keyLength, const IndexOptions &indexOptions = IndexOptions(), size_t *duplicates = NULL);
+	bool open(const string &indexFileName, const IndexOptions &indexOptions = IndexOptions());
+	void close();
+	void refresh();
+
+	bool find(const string &key, FindResult &result);
+	void findBatch(const vector<string> &keys, vector<FindResult> &results);
+	bool lookupBatch(const vector<string> &keys, vector<Lookup> &results, int strategy, size_t groupSize = 8);
+	RangeIterator range(const string &startingKey, size_t count);
+	size_t count(const string &startKey, const string &endKey);
+	int insert(const string &record);
+	void insertBatch(const vector<string> &records, vector<int> &results);
+	bool flush();
+	bool catchUp(size_t *added = NULL, size_t *duplicates = NULL);
+	bool rebuild();
+	bool verify(VerifyResult &result);
+
+	size_t keyLength() const { return metadata.keyLength; }
+	size_t recordFormat() const { return metadata.recordFormat; }
+	size_t shardCount() const { return shards.size(); }		//0 unless opened from a shard manifest
+	const string &lastError() const { return error; }
+	size_t corruptBlockCount() const;		//Block reads that failed their checksum, with verifyChecksums
+	CacheStats cacheStats() const;
+
+private:
+	friend class RangeIterator;
+
+	string fileName;
+	IndexOptions options;
+	fstream indexFile;
+	int indexFd = -1;
+	bool writable = false;
+	string error;
+	size_t corruptBlocks = 0;
+
+	Metadata metadata;
+	TreeWriter treeWriter;
+	ReaderPin readerPin;
+	BloomFilter bloom;
+	RecordCache recordCache;
+	RecordStore recordStore;
+	AsyncIO asyncIO;
+
+	const char *mappedIndex = NULL;		//Whole index mapped for in-memory lookups
+	size_t mappedLength = 0;
+	size_t mappedEpoch = 0;
+
+	vector<Index*> shards;				//Open shards of a shard manifest, in key order
+	vector<string> shardKeys;			//First key of each shard
+
+	string sidecarName;					//Buffers kept between calls, so that finds and inserts do not allocate
+	string lookupKey;
+	vector<string> singleRecord;
+	vector<int> singleResult;
+	vector<Lookup> batchLookups;		//findBatch(): the keys resolved, and the reads of their records
+	vector<size_t> batchReadFor;
+	vector<ReadRequest> batchReads;
+	vector<char> batchBuffers;
+	string batchOverflow;
+	vector<string> cacheMissedKeys;		//findBatch() with a record cache: the keys not in it, and where they go
+	vector<size_t> cacheMissedAt;
+	vector<FindResult> cacheMissedResults;
+	vector<BatchLookup> batchSteps;		//lookupBatch(): each lookup on its way down the tree
+	vector<size_t> levelOffsets;		//resolveLookupsByLevel(): the blocks of one level and their reads
+	vector<pair<size_t, size_t> > levelBlockIndex;
+	vector<char> levelBlocks;
+	vector<ReadRequest> levelReads;
+	vector<size_t> lookupGroup;			//resolveLookupsInterleaved(): the lookups under way
+	LeafCursor rangeCursor;				//Buffers for the next range iterator, handed back when it goes
+	vector<ReadRequest> rangeRequests;
+	vector<char> rangeBuffers;
+	string rangeOverflow;
+
+	map<string, string> writeBuffer;	//Records in the write-ahead log, by key
+	int walFd = -1;
+	size_t walGeneration = 0;			//Generation of the log that writeBuffer was read from
+	size_t walLength = 0;				//Bytes of the log read into writeBuffer
+
+	bool buildTree(const string &textFileName, const string &recordFileName, const string &indexFileName, size_t keyLength, const string &lowKey, const string &highKey, size_t *duplicates, const TextLines *textLines = NULL, const vector<size_t> *lineNumbers = NULL);
+	bool readBuildLine(ifstream &textFile, const TextLines *textLines, const vector<size_t> *lineNumbers, size_t &next, string &line, size_t &offset);
+	bool createShards(const string &textFileName, const string &indexFileName, size_t keyLength, size_t *duplicates);
+	bool writeShardManifest();
+	bool openShards();
+	size_t shardFor(const char *key);
+	void splitByShard(const vector<string> &keys, vector<vector<string> > &keysFor, vector<vector<size_t> > &positions);
+	bool lockWriter();
+	bool eachShard(bool (Index::*step)());
+	bool verifyTree(const string &lowKey, const string &highKey, VerifyResult &result);
+	void verifyNode(const VerifyNode &node, bool leaf, size_t indexLength, size_t recordLength, vector<VerifyNode> &children, VerifyResult &result);
+	bool insertRecords(const vector<string> &records, vector<int> &results, const vector<size_t> *textOffsets = NULL);
+	bool catchUpRange(const string &lowKey, const string &highKey, size_t &added, size_t &duplicates);
+	void bufferRecords(const vector<string> &records, vector<int> &results);
+	bool flushWriteBuffer();
+	bool findInTree(const char *key, size_t &offset);
+	void findBatchInTree(const vector<string> &keys, vector<FindResult> &results);
+	bool cacheFind(const string &key, FindResult &result);
+	void cacheAdd(const string &key, const FindResult &result);
+	void cacheErase(const string &key);
+	bool cacheSlot(const string &key, uint64_t hash, size_t &slot);
+	void cacheGrow();
+	void openWriteAheadLog(bool create);
+	void loadWriteBuffer();
+	void readWriteAheadLog();
+	bool appendToWriteAheadLog(const vector<string> &records);
+	void bulkLoadEntry(fstream &indexFile, const NodeEntry &entry, vector<NodeEntry> &leafEntries, size_t &leafBytes, vector<NodeEntry> &children, size_t &leafPage);
+	void bulkLoadFinish(fstream &indexFile, vector<NodeEntry> &leafEntries, vector<NodeEntry> &children, size_t &leafPage);
+	bool mapIndex();
+	bool readRecord(size_t offset, const char *key, string &record);
+	bool recordFromRead(ReadRequest &request, size_t offset, const char *key, RecordView &view, string &overflow);
+
+	void readBlock(fstream &indexFile, size_t offsetPtr, char block[]);
+	void writeBlock(fstream &indexFile, size_t offsetPtr, const char block[]);
+	char *findDirtyBlock(size_t offsetPtr, bool add);
+	size_t blockDataLength();
+	void sealBlock(char block[]);
+	bool blockIntact(const char block[]);
+	void decodeNode(const char block[], bool leaf, size_t &link, vector<NodeEntry> &entries);
+	void encodeNode(char block[], bool leaf, size_t link, const vector<NodeEntry> &entries);
+	size_t leafCapacity();
+	size_t packedEntrySize(const NodeEntry *previous, const NodeEntry &entry);
+	bool packLeaf(char block[], size_t link, const vector<NodeEntry> &entries);
+	size_t packedSplitPoint(const vector<NodeEntry> &entries);
+	void expandLeaf(const char block[], char leaf[]);
+	const char *openLeaf(const char block[], char expanded[]);
+	size_t allocatePage();
+	size_t pageForChangedNode(size_t offsetPtr);
+	void writeNodeSplit(fstream &indexFile, bool leaf, size_t offsetPtr, size_t link, vector<NodeEntry> &entries, size_t &leftPage, size_t &rightPage, NodeEntry &separator);
+	int insertIntoTree(fstream &indexFile, const char *key, size_t offset);
+	void beginTreeWrite(fstream &indexFile, bool copyOnWrite);
+	void commitTreeWrite(fstream &indexFile);
+	void readStableMetadata(fstream &indexFile);
+	void pinSnapshot(fstream &indexFile);
+	void unpinSnapshot();
+	size_t oldestPinnedEpoch();
+	void buildBloomFilter(vector<uint64_t> &hashes, double falsePositiveRate);
+	size_t bloomAdd(uint64_t hash);
+	bool bloomMayContain(uint64_t hash);
+	bool loadBloomFilter(const char *fileName);
+	bool bloomFilterChanged(const char *fileName);
+	void saveBloomFilter(const char *fileName);
+	void saveBloomBlock(const char *fileName, size_t blockNum);
+	const char *sidecarFileName(const char *suffix);
+	void writeMetadata(fstream &output);
+	void readMetadata(fstream &input);
+	string recordFileNameFromMetadata();
+	size_t reserveBinaryRecord(int recordFd, char page[], size_t &pageNum, const char *data, size_t length);
+	bool openRecordStore(string fileName);
+	bool fetchBinaryRecord(size_t offset, const char *&data, size_t &length);
+	int compareKeys(const char *a, const char *b);
+	bool keyInShard(const char *key);
+	const char *leafEntryKey(const char block[], size_t numRec);
+	size_t leafEntryOffset(const char block[], size_t numRec);
+	size_t leafLowerBound(const char block[], const char *key);
+	size_t childPosition(const char block[], const char *key);
+	size_t internalChild(const char block[], size_t pos);
+	size_t internalKeyCount(const char block[]);
+	size_t childForKey(const char block[], const char *key);
+	size_t descendToLeaf(fstream &indexFile, const char *key);
+	size_t cursorSeek(LeafCursor &cursor, int indexFd, const char *key);
+	size_t cursorNextLeaf(LeafCursor &cursor, int indexFd);
+	void initAsyncIO(size_t queueDepth, string engine);
+	void shutdownAsyncIO();
+	void asyncWorker();
+	void submitReads(vector<ReadRequest> &requests);
+#ifdef BPINDEX_HAVE_IO_URING
+	bool initRing(size_t queueDepth);
+	void submitRingReads(vector<ReadRequest> &requests);
+#endif
+	size_t recordReadLength();
+	void prepareRecordRead(ReadRequest &request, int recordFd, size_t offset, char *buffer);
+	void readIndexBlocks(int indexFd, vector<size_t> &offsets, vector<pair<size_t, size_t> > &blockIndex, vector<char> &blocks);
+	const char *indexedBlock(const vector<pair<size_t, size_t> > &blockIndex, const vector<char> &blocks, size_t offset);
+	void stepLeafLookup(const char block[], BatchLookup &lookup);
+	void resolveLookupsByLevel(int indexFd, vector<BatchLookup> &lookups);
+	const char *mapIndexFile(string fileName, size_t &length);
+	bool stepMappedLookup(const char *base, size_t length, BatchLookup &lookup);
+	void resolveLookupsSequential(const char *base, size_t length, vector<BatchLookup> &lookups);
+	void resolveLookupsInterleaved(const char *base, size_t length, vector<BatchLookup> &lookups, size_t groupSize);
+	void initLookup(BatchLookup &lookup, const char *key);
+};
+
+/**************************************************************************
+* Function to create an index over a text file of records, one per line,
+* each starting with its key. With the shards option above 1 the index is
+* split by key range into independent B+ tree files, and indexFileName
+* holds the shard manifest. The index is left open. duplicates, if given,
+* gets the number of lines skipped because their key was taken.
+**************************************************************************/
+inline bool Index::create(const string &textFileName, const string &indexFileName, size_t keyLength, const IndexOptions &indexOptions, size_t *duplicates)
+{
+	close();
+	options = indexOptions;
+
+	if (duplicates != NULL)
+		*duplicates = 0;
+
+	if (access(textFileName.c_str(), F_OK) == -1)
+	{
+		error = "Unable to locate file. Please enter valid file name...";
+		return false;
+	}
+
+	if (keyLength < 1 || keyLength >= sizeof(NodeEntry().key))
+	{
+		error = "Key length must be between 1 and 39...";
+		return false;
+	}
+
+	if (options.bloom && (options.bloomFalsePositiveRate <= 0 || options.bloomFalsePositiveRate >= 1))
+	{
+		error = "Bloom filter false positive rate must be between 0 and 1...";
+		return false;
+	}
+
+	if (options.shards > 1)
+	{
+		if (!createShards(textFileName, indexFileName, keyLength, duplicates))
+			return false;
+	}
+	else
+	{
+		//Binary formats copy the records into a paged record file next to the text file
+		string recordFileName = textFileName;
+		if (options.recordFormat != RECORD_FORMAT_TEXT)
+			recordFileName = textFileName + ".rec";
+
+		if (!buildTree(textFileName, recordFileName, indexFileName, keyLength, "", "", duplicates))
+			return false;
+	}
+
+	return open(indexFileName, indexOptions);
+}
+
+/**************************************************************************
+* Function to build a B+ tree file over the records of a text file whose
+* keys are from lowKey up to, but not including, highKey. An empty
+* lowKey or highKey leaves that end of the range open. With textLines,
+* the file has already been read, and only the lines in lineNumbers are
+* indexed; text records are then not read again at all.
+**************************************************************************/
+inline bool Index::buildTree(const string &textFileName, const string &recordFileName, const string &indexFileName, size_t keyLength, const string &lowKey, const string &highKey, size_t *duplicates, const TextLines *textLines, const vector<size_t> *lineNumbers)
+{
+	ifstream textFile(textFileName.c_str(), ios::in | ios::binary);
+	if (!textFile)
+	{
+		error = "Unable to locate file. Please enter valid file name...";
+		return false;
+	}
+
+	//Initialize Metadata
+	fileName = indexFileName;
+	metadata = Metadata();
+	metadata.recordFormat = options.recordFormat;
+	metadata.leafFormat = options.compressLeaves ? LEAF_FORMAT_COMPRESSED : LEAF_FORMAT_PLAIN;
+	metadata.pageChecksums = 1;
+
+	strncpy(metadata.fileName, recordFileName.c_str(), 255);
+	strncpy(metadata.textFileName, textFileName.c_str(), 255);
+
+	//A shard keeps its key range, so that it turns away keys of other shards when written to on its own
+	strncpy(metadata.lowKey, lowKey.c_str(), 40);
+	strncpy(metadata.highKey, highKey.c_str(), 40);
+
+	for (int i = strlen(metadata.fileName); i < 256; i++)
+	{
+		metadata.fileName[i] = '.';
+	}
+
+	metadata.keyLength = keyLength;
+	metadata.maxNode = (blockDataLength() - 8) / (metadata.keyLength + 8);
+
+	indexFile.open(fileName.c_str(), fstream::out | fstream::binary | fstream::trunc);
+	writeMetadata(indexFile);
+	indexFile.close();
+
+	indexFile.open(fileName.c_str(), fstream::in | fstream::out | fstream::binary);
+	if (!indexFile)
+	{
+		error = "Unable to create the index file...";
+		return false;
+	}
+
+	ofstream binaryFile;
+	char recordPage[RECORD_PAGE_SIZE];
+	size_t pageNum = 0;
+
+	if (metadata.recordFormat != RECORD_FORMAT_TEXT)
+	{
+		binaryFile.open(recordFileName.c_str(), ios::out | ios::binary | ios::trunc);
+		initRecordPage(recordPage);
+	}
+
+	// Create index
+	string line;
+	size_t offset_count = 0;
+	size_t next = 0;
+	vector<uint64_t> keyHashes;
+
+	beginTreeWrite(indexFile, false);
+
+	while (readBuildLine(textFile, textLines, lineNumbers, next, line, offset_count))
+	{
+		char key[41] = {};
+		strncpy(key, line.c_str(), metadata.keyLength);
+
+		if (!lowKey.empty() && compareKeys(key, lowKey.c_str()) < 0)
+			continue;
+		if (!highKey.empty() && compareKeys(key, highKey.c_str()) >= 0)
+			continue;
+
+		size_t recordOffset = offset_count;
+
+		if (metadata.recordFormat != RECORD_FORMAT_TEXT)
+		{
+			size_t skip = 0;
+			size_t slot;
+
+			if (metadata.recordFormat == RECORD_FORMAT_COLUMNAR)
+				skip = min(line.length(), metadata.keyLength);
+
+			if (!addRecordToPage(recordPage, line.c_str() + skip, line.length() - skip, slot))
+			{
+				binaryFile.write(recordPage, RECORD_PAGE_SIZE);
+				pageNum++;
+				initRecordPage(recordPage);
+
+				if (!addRecordToPage(recordPage, line.c_str() + skip, line.length() - skip, slot))
+				{
+					error = "Record is too long to fit in a record page...";
+					indexFile.close();
+					return false;
+				}
+			}
+
+			recordOffset = (pageNum << RECORD_SLOT_BITS) | slot;
+		}
+
+		if (insertIntoTree(indexFile, key, recordOffset) != 0)
+		{
+			if (duplicates != NULL)
+				(*duplicates)++;
+		}
+		else if (options.bloom)
+			keyHashes.push_back(hashKey(key, metadata.keyLength));
+	}
+
+	metadata.textLength = textLines != NULL ? textLines->offsets.back() : next;
+
+	commitTreeWrite(indexFile);
+	indexFile.close();
+
+	if (metadata.recordFormat != RECORD_FORMAT_TEXT)
+	{
+		binaryFile.write(recordPage, RECORD_PAGE_SIZE);
+		binaryFile.close();
+	}
+
+	//Build the Bloom filter sidecar over every key so that lookups for missing keys skip the index
+	if (options.bloom)
+	{
+		buildBloomFilter(keyHashes, options.bloomFalsePositiveRate);
+		saveBloomFilter(sidecarFileName(".bloom"));
+	}
+
+	return true;
+}
+
+/**************************************************************************
+* Function to get the next line buildTree() indexes and where it starts:
+* the next whole line of the text file, or with textLines the next line
+* of lineNumbers. Text format records only need their key from those.
+* next is where the text file has been read up to, or the count of
+* lineNumbers used. Returns false after the last line.
+**************************************************************************/
+inline bool Index::readBuildLine(ifstream &textFile, const TextLines *textLines, const vector<size_t> *lineNumbers, size_t &next, string &line, size_t &offset)
+{
+	if (textLines == NULL)
+	{
+		//A last line without its newline may still be being written, so it is left for catchUp()
+		if (!getline(textFile, line) || textFile.eof())
+			return false;
+
+		offset = next;
+		next = next + line.length() + 1;
+		return true;
+	}
+
+	if (next == lineNumbers->size())
+		return false;
+
+	size_t lineNumber = (*lineNumbers)[next++];
+	offset = textLines->offsets[lineNumber];
+
+	if (metadata.recordFormat == RECORD_FORMAT_TEXT)
+	{
+		line.assign(&textLines->keys[lineNumber * metadata.keyLength], metadata.keyLength);
+		return true;
+	}
+
+	line.resize(textLines->offsets[lineNumber + 1] - offset - 1);
+	if (line.empty())
+		return true;
+
+	return pread(textLines->fd, &line[0], line.length(), offset) == (ssize_t)line.length();
+}
+
+/**************************************************************************
+* Function to split a new index into key range shards. The boundaries are
+* picked from a sample of the keys so that each shard gets about the same
+* share of the records, and the shards are then built in parallel.
+**************************************************************************/
+inline bool Index::createShards(const string &textFileName, const string &indexFileName, size_t keyLength, size_t *duplicates)
+{
+	//Sample the keys with a reservoir while keeping every key and where its
+	//line starts, so that the text file is read once; the shards are then
+	//built from their own lines, and only binary formats read those again
+	ifstream textFile(textFileName.c_str(), ios::in | ios::binary);
+	TextLines textLines;
+	vector<string> sample;
+	size_t sampleSize = SHARD_SAMPLE_KEYS * options.shards;
+	size_t numLines = 0;
+	size_t offset = 0;
+	mt19937 random(6360);
+	string line;
+
+	while (getline(textFile, line))
+	{
+		//Left for catchUp(), as in buildTree()
+		if (textFile.eof())
+			break;
+
+		char key[41] = {};
+		strncpy(key, line.c_str(), keyLength);
+
+		textLines.keys.insert(textLines.keys.end(), key, key + keyLength);
+		textLines.offsets.push_back(offset);
+		offset = offset + line.length() + 1;
+
+		if (sample.size() < sampleSize)
+			sample.push_back(string(key, keyLength));
+		else
+		{
+			size_t pick = random() % (numLines + 1);
+			if (pick < sampleSize)
+				sample[pick] = string(key, keyLength);
+		}
+
+		numLines++;
+	}
+
+	textLines.offsets.push_back(offset);
+	textLines.fd = ::open(textFileName.c_str(), O_RDONLY);
+	if (textLines.fd == -1)
+	{
+		error = "Unable to locate file. Please enter valid file name...";
+		return false;
+	}
+
+	sort(sample.begin(), sample.end());
+
+	//Shard i holds the keys from shardKeys[i] up to shardKeys[i + 1]. Too
+	//few distinct keys leave fewer shards than asked for
+	metadata = Metadata();
+	metadata.keyLength = keyLength;
+	shardKeys.assign(1, string(keyLength, '\0'));
+
+	for (size_t i = 1; i < options.shards && !sample.empty(); i++)
+	{
+		const string &boundary = sample[i * sample.size() / options.shards];
+		if (boundary > shardKeys.back())
+			shardKeys.push_back(boundary);
+	}
+
+	fileName = indexFileName;
+	if (!writeShardManifest())
+	{
+		::close(textLines.fd);
+		return false;
+	}
+
+	//The shards share nothing but the lines read above, so they are all built at once
+	size_t numShards = shardKeys.size();
+	vector<vector<size_t> > linesOf(numShards);
+
+	for (size_t i = 0; i < numLines; i++)
+		linesOf[shardFor(&textLines.keys[i * keyLength])].push_back(i);
+
+	vector<Index*> builders(numShards);
+	vector<char> built(numShards, 0);
+	vector<size_t> shardDuplicates(numShards, 0);
+	vector<thread> threads;
+
+	for (size_t i = 0; i < numShards; i++)
+	{
+		string recordFileName = textFileName;
+		if (options.recordFormat != RECORD_FORMAT_TEXT)
+			recordFileName = textFileName + ".rec." + to_string(i);
+
+		string lowKey = i > 0 ? shardKeys[i] : "";
+		string highKey = i + 1 < numShards ? shardKeys[i + 1] : "";
+
+		builders[i] = new Index();
+		builders[i]->options = options;
+
+		threads.push_back(thread([=, &builders, &built, &shardDuplicates, &textLines, &linesOf]() {
+			built[i] = builders[i]->buildTree(textFileName, recordFileName, shardFileName(indexFileName, i), keyLength, lowKey, highKey, &shardDuplicates[i], &textLines, &linesOf[i]);
+		}));
+	}
+
+	bool allBuilt = true;
+	for (size_t i = 0; i < numShards; i++)
+	{
+		threads[i].join();
+
+		if (!built[i] && allBuilt)
+		{
+			error = builders[i]->error;
+			allBuilt = false;
+		}
+
+		if (duplicates != NULL)
+			*duplicates = *duplicates + shardDuplicates[i];
+
+		delete builders[i];
+	}
+
+	::close(textLines.fd);
+
+	return allBuilt;
+}
+
+/**************************************************************************
+* Function to write the shard manifest. The file holds an 8 byte magic,
+* the key length and shard count, then the first key of each shard
+* padded to 40 bytes. Shard i is the index file name + "." + i.
+**************************************************************************/
+inline bool Index::writeShardManifest()
+{
+	ofstream manifestFile(fileName.c_str(), ios::out | ios::binary | ios::trunc);
+	size_t numShards = shardKeys.size();
+
+	manifestFile.write("BPSHARD1", 8);
+	manifestFile.write((char*)&metadata.keyLength, 8);
+	manifestFile.write((char*)&numShards, 8);
+
+	for (size_t i = 0; i < numShards; i++)
+	{
+		char key[40] = {};
+		memcpy(key, shardKeys[i].c_str(), metadata.keyLength);
+		manifestFile.write(key, 40);
+	}
+
+	if (!manifestFile)
+	{
+		error = "Unable to create the index file...";
+		return false;
+	}
+
+	return true;
+}
+
+/**************************************************************************
+* Function to open every shard named in a shard manifest
+**************************************************************************/
+inline bool Index::openShards()
+{
+	ifstream manifestFile(fileName.c_str(), ios::in | ios::binary);
+	char magic[8];
+	size_t numShards = 0;
+
+	manifestFile.read(magic, 8);
+	manifestFile.read((char*)&metadata.keyLength, 8);
+	manifestFile.read((char*)&numShards, 8);
+
+	for (size_t i = 0; manifestFile && i < numShards; i++)
+	{
+		char key[40];
+		manifestFile.read(key, 40);
+		shardKeys.push_back(string(key, metadata.keyLength));
+	}
+
+	if (!manifestFile || numShards == 0 || metadata.keyLength < 1 || metadata.keyLength >= 40)
+	{
+		error = "Unable to read the shard manifest...";
+		return false;
+	}
+
+	//Each shard caches the records of its own keys
+	IndexOptions shardOptions = options;
+	shardOptions.cacheBytes = options.cacheBytes / numShards;
+
+	for (size_t i = 0; i < numShards; i++)
+	{
+		shards.push_back(new Index());
+
+		if (!shards[i]->open(shardFileName(fileName, i), shardOptions))
+		{
+			error = shards[i]->error;
+			return false;
+		}
+	}
+
+	metadata.recordFormat = shards[0]->metadata.recordFormat;
+	return true;
+}
+
+/**************************************************************************
+* Function to pick the shard a key belongs in
+**************************************************************************/
+inline size_t Index::shardFor(const char *key)
+{
+	size_t shard = 0;
+
+	while (shard + 1 < shardKeys.size() && compareKeys(key, shardKeys[shard + 1].c_str()) >= 0)
+		shard++;
+
+	return shard;
+}
+
+/**************************************************************************
+* Function to split a batch of keys, or of records starting with their
+* keys, by shard. positions[s] holds where in keys each of keysFor[s]
+* came from.
+**************************************************************************/
+inline void Index::splitByShard(const vector<string> &keys, vector<vector<string> > &keysFor, vector<vector<size_t> > &positions)
+{
+	keysFor.assign(shards.size(), vector<string>());
+	positions.assign(shards.size(), vector<size_t>());
+
+	for (size_t i = 0; i < keys.size(); i++)
+	{
+		char key[41] = {};
+		strncpy(key, keys[i].c_str(), metadata.keyLength);
+
+		size_t shard = shardFor(key);
+		keysFor[shard].push_back(keys[i]);
+		positions[shard].push_back(i);
+	}
+}
+
+/**************************************************************************
+* Function to open an index and pin its current snapshot. A shard
+* manifest opens all of its shards.
+**************************************************************************/
+inline bool Index::open(const string &indexFileName, const IndexOptions &indexOptions)
+{
+	close();
+	options = indexOptions;
+
+	if (access(indexFileName.c_str(), F_OK) == -1)
+	{
+		error = "Unable to locate file. Please enter valid file name...";
+		return false;
+	}
+
+	fileName = indexFileName;
+
+	char magic[8] = {};
+	ifstream probe(fileName.c_str(), ios::in | ios::binary);
+	probe.read(magic, 8);
+
+	if (memcmp(magic, "BPSHARD1", 8) == 0)
+	{
+		if (openShards())
+			return true;
+
+		string shardError = error;
+		close();
+		error = shardError;
+		return false;
+	}
+
+	//Read only indexes can still be searched
+	indexFile.open(fileName.c_str(), ios::in | ios::out | ios::binary);
+	writable = indexFile.is_open();
+	if (!writable)
+		indexFile.open(fileName.c_str(), ios::in | ios::binary);
+
+	indexFd = ::open(fileName.c_str(), O_RDONLY);
+	if (!indexFile.is_open() || indexFd == -1)
+	{
+		error = "Unable to open the index file...";
+		close();
+		return false;
+	}
+
+	//The write buffer is read before the root is pinned, so that records
+	//flushed in between are in one or the other
+	readMetadata(indexFile);
+	loadWriteBuffer();
+
+	//Read in the metadablock and pin the current root
+	pinSnapshot(indexFile);
+
+	openRecordStore(recordFileNameFromMetadata());
+	loadBloomFilter(sidecarFileName(".bloom"));
+
+	recordCache.capacity = options.cacheBytes;
+
+	return true;
+}
+
+/**************************************************************************
+* Function to close the index and release everything it holds
+**************************************************************************/
+inline void Index::close()
+{
+	for (size_t i = 0; i < shards.size(); i++)
+		delete shards[i];
+
+	shards.clear();
+	shardKeys.clear();
+
+	unpinSnapshot();
+	shutdownAsyncIO();
+
+	if (mappedIndex != NULL)
+		munmap((void*)mappedIndex, mappedLength);
+	if (recordStore.map != NULL)
+		munmap(recordStore.map, recordStore.mapLength);
+	if (recordStore.fd != -1)
+		::close(recordStore.fd);
+	if (recordStore.writeFd != -1)
+		::close(recordStore.writeFd);
+	if (indexFd != -1)
+		::close(indexFd);
+	if (walFd != -1)
+		::close(walFd);
+
+	indexFile.close();
+	indexFile.clear();
+
+	mappedIndex = NULL;
+	mappedLength = 0;
+	recordStore.fd = -1;
+	recordStore.writeFd = -1;
+	recordStore.map = NULL;
+	recordStore.mapLength = 0;
+	indexFd = -1;
+	walFd = -1;
+	walGeneration = 0;
+	walLength = 0;
+	writable = false;
+
+	writeBuffer.clear();
+	metadata = Metadata();
+	bloom = BloomFilter();
+	recordCache = RecordCache();
+}
+
+/**************************************************************************
+* Function to move on to the latest snapshot of the tree
+**************************************************************************/
+inline void Index::refresh()
+{
+	for (size_t i = 0; i < shards.size(); i++)
+		shards[i]->refresh();
+
+	if (indexFd == -1)
+		return;
+
+	loadWriteBuffer();
+
+	unpinSnapshot();
+	pinSnapshot(indexFile);
+
+	//Keys other writers added are in the filter on disk; the old copy would turn them away
+	if (bloomFilterChanged(sidecarFileName(".bloom")))
+	{
+		bloom.loaded = false;
+		loadBloomFilter(sidecarFileName(".bloom"));
+	}
+}
+
+/**************************************************************************
+* Function to find a specific record. Returns false if the key is not in
+* the index. Records found in the tree are kept in the record cache, if
+* there is one, so keys asked for again skip the tree.
+**************************************************************************/
+inline bool Index::find(const string &key, FindResult &result)
+{
+	result = FindResult();
+
+	char searchKey[41] = {};
+	strncpy(searchKey, key.c_str(), metadata.keyLength);
+
+	if (!shards.empty())
+		return shards[shardFor(searchKey)]->find(key, result);
+
+	//Only the write buffer and the record cache need the key as a string
+	if (!writeBuffer.empty() || recordCache.capacity > 0)
+		lookupKey.assign(searchKey, metadata.keyLength);
+
+	//Records not yet flushed into the tree are served from the write buffer
+	map<string, string>::iterator buffered = writeBuffer.empty() ? writeBuffer.end() : writeBuffer.find(lookupKey);
+	if (buffered != writeBuffer.end())
+	{
+		result.found = true;
+		result.buffered = true;
+		result.readable = true;
+		result.record = buffered->second;
+		return true;
+	}
+
+	if (recordCache.capacity > 0 && cacheFind(lookupKey, result))
+		return true;
+
+	//A key the Bloom filter has never seen cannot be in the index, so skip the descent
+	if (bloom.loaded && !bloomMayContain(hashKey(searchKey, metadata.keyLength)))
+		return false;
+
+	if (!findInTree(searchKey, result.offset))
+		return false;
+
+	result.found = true;
+	result.readable = readRecord(result.offset, searchKey, result.record);
+
+	if (result.readable && recordCache.capacity > 0)
+		cacheAdd(lookupKey, result);
+
+	return true;
+}
+
+/**************************************************************************
+* Function to look a key up in the tree of the current metadata. Returns
+* false if it is not there.
+**************************************************************************/
+inline bool Index::findInTree(const char *key, size_t &offset)
+{
+	if (metadata.root == 0)
+		return false;
+
+	//Search for the leaf node that the entry should be in
+	size_t searchPtr = descendToLeaf(indexFile, key);
+	if (searchPtr == 0)
+		return false;
+
+	char block[1024];
+	char expanded[LEAF_BUFFER_SIZE];
+	readBlock(indexFile, searchPtr, block);
+	if (!blockIntact(block))
+		return false;
+
+	const char *leaf = openLeaf(block, expanded);
+	size_t numRec = leafLowerBound(leaf, key);
+
+	if (isNullKey(leafEntryKey(leaf, numRec)) || compareKeys(key, leafEntryKey(leaf, numRec)) != 0)
+		return false;
+
+	offset = leafEntryOffset(leaf, numRec);
+	return true;
+}
+
+/**************************************************************************
+* Function to look a key up in the record cache. The cache is a segmented
+* LRU: records enter on probation, and move to the protected segment,
+* which may fill four fifths of the cache, when they are hit again. Keys
+* asked for once, as by a scan, so leave the hot keys where they are.
+**************************************************************************/
+inline bool Index::cacheFind(const string &key, FindResult &result)
+{
+	if (recordCache.capacity == 0)
+		return false;
+
+	size_t slot;
+	if (recordCache.entries == 0 || !cacheSlot(key, hashKey(key.c_str(), key.length()), slot))
+	{
+		recordCache.misses++;
+		return false;
+	}
+
+	recordCache.hits++;
+	list<CacheEntry>::iterator entry = recordCache.slots[slot].entry;
+
+	if (entry->protectedEntry)
+		recordCache.protectedList.splice(recordCache.protectedList.begin(), recordCache.protectedList, entry);
+	else
+	{
+		entry->protectedEntry = true;
+		recordCache.protectedBytes = recordCache.protectedBytes + entry->bytes;
+		recordCache.protectedList.splice(recordCache.protectedList.begin(), recordCache.probation, entry);
+
+		//The protected segment overflows back onto probation, least recently hit first
+		while (recordCache.protectedBytes > recordCache.capacity / 5 * 4)
+		{
+			list<CacheEntry>::iterator demoted = --recordCache.protectedList.end();
+			demoted->protectedEntry = false;
+			recordCache.protectedBytes = recordCache.protectedBytes - demoted->bytes;
+			recordCache.probation.splice(recordCache.probation.begin(), recordCache.protectedList, demoted);
+		}
+	}
+
+	result.found = true;
+	result.readable = true;
+	result.offset = entry->offset;
+	result.record = entry->record;
+
+	return true;
+}
+
+/**************************************************************************
+* Function to put a record found in the tree into the record cache,
+* making room from the least recently used records on probation. An
+* entry evicted earlier is reused, strings and all, so that a warmed up
+* cache does not allocate.
+**************************************************************************/
+inline void Index::cacheAdd(const string &key, const FindResult &result)
+{
+	size_t bytes = key.length() + result.record.length() + CACHE_ENTRY_OVERHEAD;
+
+	if (recordCache.capacity == 0 || bytes > recordCache.capacity)
+		return;
+
+	if ((recordCache.entries + 1) * 2 > recordCache.slots.size())
+		cacheGrow();
+
+	uint64_t hash = hashKey(key.c_str(), key.length());
+	size_t slot;
+	if (cacheSlot(key, hash, slot))
+		return;
+
+	if (recordCache.spare.empty())
+		recordCache.probation.push_front(CacheEntry());
+	else
+		recordCache.probation.splice(recordCache.probation.begin(), recordCache.spare, recordCache.spare.begin());
+
+	list<CacheEntry>::iterator entry = recordCache.probation.begin();
+	entry->key.assign(key);
+	entry->offset = result.offset;
+	entry->record.assign(result.record);
+	entry->bytes = bytes;
+	entry->protectedEntry = false;
+
+	recordCache.slots[slot].used = true;
+	recordCache.slots[slot].hash = hash;
+	recordCache.slots[slot].entry = entry;
+	recordCache.entries++;
+	recordCache.bytes = recordCache.bytes + bytes;
+
+	//The key evicted is read where it is; the entry stays alive on the spare list
+	while (recordCache.bytes > recordCache.capacity)
+	{
+		list<CacheEntry> &segment = recordCache.probation.empty() ? recordCache.protectedList : recordCache.probation;
+		cacheErase(segment.back().key);
+	}
+}
+
+/**************************************************************************
+* Function to drop a key from the record cache. Its entry goes to the
+* spare list, and the slots after it in its probe run move back into
+* the gap, so that the table needs no markers for deleted keys.
+**************************************************************************/
+inline void Index::cacheErase(const string &key)
+{
+	size_t slot;
+	if (recordCache.entries == 0 || !cacheSlot(key, hashKey(key.c_str(), key.length()), slot))
+		return;
+
+	list<CacheEntry>::iterator entry = recordCache.slots[slot].entry;
+	recordCache.bytes = recordCache.bytes - entry->bytes;
+
+	if (entry->protectedEntry)
+	{
+		recordCache.protectedBytes = recordCache.protectedBytes - entry->bytes;
+		recordCache.spare.splice(recordCache.spare.begin(), recordCache.protectedList, entry);
+	}
+	else
+		recordCache.spare.splice(recordCache.spare.begin(), recordCache.probation, entry);
+
+	recordCache.entries--;
+
+	vector<CacheSlot> &slots = recordCache.slots;
+	size_t mask = slots.size() - 1;
+	size_t gap = slot;
+	slots[gap].used = false;
+
+	for (size_t next = (gap + 1) & mask; slots[next].used; next = (next + 1) & mask)
+	{
+		//A key whose home slot lies cyclically after the gap, up to where it is, has to stay
+		size_t home = slots[next].hash & mask;
+		if (((next - home) & mask) < ((next - gap) & mask))
+			continue;
+
+		slots[gap] = slots[next];
+		slots[next].used = false;
+		gap = next;
+	}
+}
+
+/**************************************************************************
+* Function to find the slot of a key in the record cache. Returns false,
+* with the empty slot the key would go in, if it is not there.
+**************************************************************************/
+inline bool Index::cacheSlot(const string &key, uint64_t hash, size_t &slot)
+{
+	size_t mask = recordCache.slots.size() - 1;
+
+	for (slot = hash & mask; recordCache.slots[slot].used; slot = (slot + 1) & mask)
+		if (recordCache.slots[slot].hash == hash && recordCache.slots[slot].entry->key == key)
+			return true;
+
+	return false;
+}
+
+/**************************************************************************
+* Function to double the slots of the record cache, keeping them at most
+* half full
+**************************************************************************/
+inline void Index::cacheGrow()
+{
+	vector<CacheSlot> old;
+	old.swap(recordCache.slots);
+	recordCache.slots.resize(max((size_t)64, old.size() * 2));
+
+	size_t mask = recordCache.slots.size() - 1;
+
+	for (size_t i = 0; i < old.size(); i++)
+	{
+		if (!old[i].used)
+			continue;
+
+		size_t slot = old[i].hash & mask;
+		while (recordCache.slots[slot].used)
+			slot = (slot + 1) & mask;
+
+		recordCache.slots[slot] = old[i];
+	}
+}
+
+/**************************************************************************
+* Function to get the record cache statistics, over every shard
+**************************************************************************/
+inline CacheStats Index::cacheStats() const
+{
+	CacheStats stats;
+	stats.hits = recordCache.hits;
+	stats.misses = recordCache.misses;
+	stats.entries = recordCache.entries;
+	stats.bytes = recordCache.bytes;
+
+	for (size_t s = 0; s < shards.size(); s++)
+	{
+		CacheStats shardStats = shards[s]->cacheStats();
+		stats.hits = stats.hits + shardStats.hits;
+		stats.misses = stats.misses + shardStats.misses;
+		stats.entries = stats.entries + shardStats.entries;
+		stats.bytes = stats.bytes + shardStats.bytes;
+	}
+
+	return stats;
+}
+
+/**************************************************************************
+* Function to find a batch of records. The lookups are resolved either by
+* reading the index level by level, or with the mmap option against the
+* mapped index with groupSize lookups interleaved. The record reads for
+* every key found are then in flight at once. Keys in the record cache
+* skip all of that. The shards of a shard manifest each take their share
+* of the keys in parallel.
+**************************************************************************/
+inline void Index::findBatch(const vector<string> &keys, vector<FindResult> &results)
+{
+	if (!shards.empty())
+	{
+		vector<vector<string> > keysFor;
+		vector<vector<size_t> > positions;
+		vector<vector<FindResult> > resultsFor(shards.size());
+		vector<thread> threads;
+
+		splitByShard(keys, keysFor, positions);
+
+		for (size_t s = 0; s < shards.size(); s++)
+			if (!keysFor[s].empty())
+				threads.push_back(thread(&Index::findBatch, shards[s], cref(keysFor[s]), ref(resultsFor[s])));
+
+		for (size_t i = 0; i < threads.size(); i++)
+			threads[i].join();
+
+		results.assign(keys.size(), FindResult());
+		for (size_t s = 0; s < shards.size(); s++)
+			for (size_t i = 0; i < positions[s].size(); i++)
+				swap(results[positions[s][i]], resultsFor[s][i]);
+
+		return;
+	}
+
+	if (recordCache.capacity == 0)
+	{
+		findBatchInTree(keys, results);
+		return;
+	}
+
+	//Keys in the record cache are answered from it; the rest are looked up together
+	vector<string> &missedKeys = cacheMissedKeys;
+	vector<size_t> &missedAt = cacheMissedAt;
+	vector<FindResult> &missedResults = cacheMissedResults;
+	size_t missed = 0;
+
+	missedAt.clear();
+	results.resize(keys.size());
+
+	for (size_t i = 0; i < keys.size(); i++)
+	{
+		char searchKey[41] = {};
+		strncpy(searchKey, keys[i].c_str(), metadata.keyLength);
+
+		results[i].found = false;
+		results[i].offset = 0;
+		results[i].readable = false;
+		results[i].buffered = false;
+		results[i].record.clear();
+
+		lookupKey.assign(searchKey, metadata.keyLength);
+		if (cacheFind(lookupKey, results[i]))
+			continue;
+
+		//The key strings are assigned over, not made again
+		if (missed < missedKeys.size())
+			missedKeys[missed].assign(keys[i]);
+		else
+			missedKeys.push_back(keys[i]);
+
+		missed++;
+		missedAt.push_back(i);
+	}
+
+	missedKeys.resize(missed);
+	findBatchInTree(missedKeys, missedResults);
+
+	for (size_t i = 0; i < missedKeys.size(); i++)
+	{
+		char searchKey[41] = {};
+		strncpy(searchKey, missedKeys[i].c_str(), metadata.keyLength);
+
+		lookupKey.assign(searchKey, metadata.keyLength);
+		if (missedResults[i].readable && !missedResults[i].buffered)
+			cacheAdd(lookupKey, missedResults[i]);
+
+		swap(results[missedAt[i]], missedResults[i]);
+	}
+}
+
+/**************************************************************************
+* Function to find a batch of records in the tree and the write buffer,
+* without the record cache
+**************************************************************************/
+inline void Index::findBatchInTree(const vector<string> &keys, vector<FindResult> &results)
+{
+	vector<Lookup> &lookups = batchLookups;
+
+	if (!options.mmap || !lookupBatch(keys, lookups, LOOKUP_MAPPED_INTERLEAVED, options.groupSize))
+		lookupBatch(keys, lookups, LOOKUP_BY_LEVEL);
+
+	//Records
+	size_t recordReadSize = recordReadLength();
+	vector<ReadRequest> &requests = batchReads;
+	vector<size_t> &requestFor = batchReadFor;
+	vector<char> &buffers = batchBuffers;
+
+	requests.clear();
+	requestFor.resize(lookups.size());
+
+	for (size_t i = 0; i < lookups.size(); i++)
+	{
+		if (!lookups[i].found || lookups[i].buffered)
+			continue;
+
+		requestFor[i] = requests.size();
+		requests.push_back(ReadRequest());
+	}
+
+	buffers.resize(requests.size() * recordReadSize);
+
+	for (size_t i = 0; i < lookups.size(); i++)
+		if (lookups[i].found && !lookups[i].buffered)
+			prepareRecordRead(requests[requestFor[i]], recordStore.fd, lookups[i].offset, &buffers[requestFor[i] * recordReadSize]);
+
+	submitReads(requests);
+
+	results.resize(keys.size());
+
+	for (size_t i = 0; i < lookups.size(); i++)
+	{
+		results[i].found = false;
+		results[i].offset = 0;
+		results[i].readable = false;
+		results[i].buffered = false;
+		results[i].record.clear();
+
+		if (!lookups[i].found || lookups[i].buffered)
+			continue;
+
+		char key[41] = {};
+		strncpy(key, keys[i].c_str(), metadata.keyLength);
+
+		RecordView view;
+		results[i].found = true;
+		results[i].offset = lookups[i].offset;
+		results[i].readable = recordFromRead(requests[requestFor[i]], lookups[i].offset, key, view, batchOverflow);
+		results[i].record.assign(view.data != NULL ? view.data : "", view.length);
+	}
+
+	for (size_t i = 0; i < lookups.size(); i++)
+	{
+		if (!lookups[i].buffered)
+			continue;
+
+		char key[41] = {};
+		strncpy(key, keys[i].c_str(), metadata.keyLength);
+
+		lookupKey.assign(key, metadata.keyLength);
+		results[i].found = true;
+		results[i].buffered = true;
+		results[i].readable = true;
+		results[i].record = writeBuffer[lookupKey];
+	}
+}
+
+/**************************************************************************
+* Function to resolve a batch of keys to record offsets without reading
+* the records. Returns false if a mapped strategy was asked for and the
+* index could not be mapped.
+**************************************************************************/
+inline bool Index::lookupBatch(const vector<string> &keys, vector<Lookup> &results, int strategy, size_t groupSize)
+{
+	if (!shards.empty())
+	{
+		vector<vector<string> > keysFor;
+		vector<vector<size_t> > positions;
+		vector<vector<Lookup> > resultsFor(shards.size());
+		vector<char> resolved(shards.size(), 1);
+		vector<thread> threads;
+
+		splitByShard(keys, keysFor, positions);
+
+		for (size_t s = 0; s < shards.size(); s++)
+		{
+			if (keysFor[s].empty())
+				continue;
+
+			threads.push_back(thread([=, &keysFor, &resultsFor, &resolved]() {
+				resolved[s] = shards[s]->lookupBatch(keysFor[s], resultsFor[s], strategy, groupSize);
+			}));
+		}
+
+		for (size_t i = 0; i < threads.size(); i++)
+			threads[i].join();
+
+		results.resize(keys.size());
+		for (size_t s = 0; s < shards.size(); s++)
+		{
+			if (!resolved[s])
+			{
+				error = shards[s]->error;
+				return false;
+			}
+
+			for (size_t i = 0; i < positions[s].size(); i++)
+				results[positions[s][i]] = resultsFor[s][i];
+		}
+
+		return true;
+	}
+
+	vector<BatchLookup> &lookups = batchSteps;
+	lookups.resize(keys.size());
+
+	if (strategy != LOOKUP_BY_LEVEL && !mapIndex())
+	{
+		error = "Unable to map index.";
+		return false;
+	}
+
+	for (size_t i = 0; i < keys.size(); i++)
+	{
+		initLookup(lookups[i], keys[i].c_str());
+
+		if (bloom.loaded && !bloomMayContain(hashKey(lookups[i].key, metadata.keyLength)))
+			lookups[i].active = false;
+	}
+
+	if (strategy == LOOKUP_BY_LEVEL)
+		resolveLookupsByLevel(indexFd, lookups);
+	else if (strategy == LOOKUP_MAPPED_SEQUENTIAL)
+		resolveLookupsSequential(mappedIndex, mappedLength, lookups);
+	else
+		resolveLookupsInterleaved(mappedIndex, mappedLength, lookups, groupSize);
+
+	results.resize(keys.size());
+	for (size_t i = 0; i < keys.size(); i++)
+	{
+		results[i].found = lookups[i].found;
+		results[i].offset = lookups[i].offset;
+		results[i].buffered = false;
+
+		//Records not yet flushed into the tree are in the write buffer
+		if (writeBuffer.empty())
+			continue;
+
+		lookupKey.assign(lookups[i].key, metadata.keyLength);
+		if (writeBuffer.count(lookupKey) > 0)
+		{
+			results[i].found = true;
+			results[i].offset = nullOffset;
+			results[i].buffered = true;
+		}
+	}
+
+	return true;
+}
+
+/**************************************************************************
+* Function to start a range of at most count entries, from the first key
+* not less than startingKey. Over a shard manifest the range starts in
+* the shard the key belongs in and runs on through the shards after it.
+**************************************************************************/
+inline RangeIterator Index::range(const string &startingKey, size_t count)
+{
+	RangeIterator it;
+	it.index = this;
+	it.owner = this;
+	it.swapBuffers();
+
+	char key[41] = {};
+	strncpy(key, startingKey.c_str(), metadata.keyLength);
+
+	if (!shards.empty())
+	{
+		it.sharded = this;
+		it.shard = shardFor(key);
+		it.index = shards[it.shard];
+	}
+
+	it.remaining = count;
+	it.start(key);
+
+	return it;
+}
+
+/**************************************************************************
+* Function to count the keys from startKey up to and including endKey.
+* Only the index is read, never the records.
+**************************************************************************/
+inline size_t Index::count(const string &startKey, const string &endKey)
+{
+	char lastKey[41] = {};
+	strncpy(lastKey, endKey.c_str(), metadata.keyLength);
+
+	size_t numKeys = 0;
+
+	for (RangeIterator it = range(startKey, (size_t)-1); it.valid() && compareKeys(it.key(), lastKey) <= 0; it.next())
+		numKeys++;
+
+	return numKeys;
+}
+
+/**************************************************************************
+* Function to insert a new record, which starts with its key. Returns one
+* of the INSERT_* values.
+**************************************************************************/
+inline int Index::insert(const string &record)
+{
+	singleRecord.resize(1);
+	singleRecord[0] = record;
+
+	insertBatch(singleRecord, singleResult);
+
+	return singleResult[0];
+}
+
+/**************************************************************************
+* Function to insert a batch of records as one change to the tree. Writers
+* take turns on the index; readers never wait for them and see either
+* none or all of the batch. results gets one of the INSERT_* values for
+* each record. The shards of a shard manifest each take their share of
+* the records in parallel.
+**************************************************************************/
+inline void Index::insertBatch(const vector<string> &records, vector<int> &results)
+{
+	results.assign(records.size(), INSERT_FAILED);
+
+	if (!shards.empty())
+	{
+		vector<vector<string> > recordsFor;
+		vector<vector<size_t> > positions;
+		vector<vector<int> > resultsFor(shards.size());
+		vector<thread> threads;
+
+		splitByShard(records, recordsFor, positions);
+
+		for (size_t s = 0; s < shards.size(); s++)
+			if (!recordsFor[s].empty())
+				threads.push_back(thread(&Index::insertBatch, shards[s], cref(recordsFor[s]), ref(resultsFor[s])));
+
+		for (size_t i = 0; i < threads.size(); i++)
+			threads[i].join();
+
+		for (size_t s = 0; s < shards.size(); s++)
+		{
+			for (size_t i = 0; i < positions[s].size(); i++)
+			{
+				results[positions[s][i]] = resultsFor[s][i];
+				if (resultsFor[s][i] == INSERT_FAILED)
+					error = shards[s]->error;
+			}
+		}
+
+		return;
+	}
+
+	if (records.empty())
+		return;
+
+	if (!writable)
+	{
+		error = "Unable to open the index for writing...";
+		return;
+	}
+
+	if (!lockWriter())
+		return;
+
+	//Another writer may have moved the tree on, or added to the write buffer,
+	//since this index was opened
+	readMetadata(indexFile);
+	openWriteAheadLog(options.writeBuffer > 0);
+	readWriteAheadLog();
+
+	if (options.writeBuffer > 0)
+	{
+		bufferRecords(records, results);
+
+		if (writeBuffer.size() >= options.writeBuffer)
+			flushWriteBuffer();
+	}
+	//Records already buffered go into the tree first, where the new ones are checked against them
+	else if (flushWriteBuffer())
+		insertRecords(records, results);
+
+	flock(indexFd, LOCK_UN);
+
+	//A cached record for a key written here is dropped, so that finds read the new one
+	for (size_t i = 0; i < records.size() && recordCache.capacity > 0; i++)
+	{
+		if (results[i] != INSERT_DONE)
+			continue;
+
+		char key[41] = {};
+		strncpy(key, records[i].c_str(), metadata.keyLength);
+
+		lookupKey.assign(key, metadata.keyLength);
+		cacheErase(lookupKey);
+	}
+
+	//Move on to the snapshot that holds the new records
+	refresh();
+}
+
+/**************************************************************************
+* Function to insert records into the tree as one change. The caller
+* holds the writer lock. With textOffsets, text format records are
+* already in the text file at those offsets and are not appended to it.
+* The record file is locked while records are added to it, since the
+* shards of a text index all append to the one text file.
+* Returns false if the record file could not be opened.
+**************************************************************************/
+inline bool Index::insertRecords(const vector<string> &records, vector<int> &results, const vector<size_t> *textOffsets)
+{
+	if (recordStore.writeFd == -1)
+		recordStore.writeFd = ::open(recordFileNameFromMetadata().c_str(), O_RDWR);
+
+	//The end of the file is only ours to write past while the lock is held
+	bool appending = metadata.recordFormat != RECORD_FORMAT_TEXT || textOffsets == NULL;
+	if (recordStore.writeFd != -1 && appending)
+		flock(recordStore.writeFd, LOCK_EX);
+
+	struct stat recordStat;
+	if (recordStore.writeFd == -1 || fstat(recordStore.writeFd, &recordStat) != 0)
+	{
+		if (recordStore.writeFd != -1 && appending)
+			flock(recordStore.writeFd, LOCK_UN);
+
+		error = "Unable to open the record file " + recordFileNameFromMetadata() + "...";
+		return false;
+	}
+
+	int recordFd = recordStore.writeFd;
+	size_t recordEnd = recordStat.st_size;		//New text records go on the end of the file
+
+	//Copy on write: the new leaves and their paths up to the root go to new pages,
+	//and readers keep seeing the old root until the metadata is rewritten
+	beginTreeWrite(indexFile, true);
+
+	char nl[1] = { '\n' };
+	vector<uint64_t> &keyHashes = treeWriter.keyHashes;
+	keyHashes.clear();
+
+	for (size_t i = 0; i < records.size(); i++)
+	{
+		const string &record = records[i];
+
+		char key[41] = {};
+		strncpy(key, record.c_str(), metadata.keyLength);
+
+		if (!keyInShard(key))
+		{
+			error = "Key belongs to another shard; insert it through the shard manifest...";
+			continue;
+		}
+
+		//Binary records go into the last page with room; the index stores its (page, slot)
+		char recordPage[RECORD_PAGE_SIZE];
+		size_t pageNum = 0;
+		size_t offsetEnd = recordEnd;
+
+		if (metadata.recordFormat != RECORD_FORMAT_TEXT)
+		{
+			size_t skip = 0;
+			if (metadata.recordFormat == RECORD_FORMAT_COLUMNAR)
+				skip = min(record.length(), metadata.keyLength);
+
+			if (record.length() - skip > RECORD_PAGE_SIZE - 8)
+			{
+				error = "Record is too long to fit in a record page...";
+				continue;
+			}
+
+			offsetEnd = reserveBinaryRecord(recordFd, recordPage, pageNum, record.c_str() + skip, record.length() - skip);
+		}
+		else if (textOffsets != NULL)
+			offsetEnd = (*textOffsets)[i];
+
+		if (insertIntoTree(indexFile, key, offsetEnd) != 0)
+		{
+			results[i] = INSERT_DUPLICATE;
+			continue;
+		}
+
+		if (metadata.recordFormat != RECORD_FORMAT_TEXT)
+			pwrite(recordFd, recordPage, RECORD_PAGE_SIZE, pageNum * RECORD_PAGE_SIZE);
+		else if (textOffsets == NULL)
+		{
+			pwrite(recordFd, record.c_str(), record.length(), recordEnd);
+			pwrite(recordFd, nl, 1, recordEnd + record.length());
+
+			//A line appended right after the indexed part of the text file leaves nothing for catchUp() to read
+			if (metadata.textLength == recordEnd)
+				metadata.textLength = recordEnd + record.length() + 1;
+
+			recordEnd = recordEnd + record.length() + 1;
+		}
+
+		keyHashes.push_back(hashKey(key, metadata.keyLength));
+		results[i] = INSERT_DONE;
+	}
+
+	if (!keyHashes.empty())
+	{
+		//The records were written straight to the file, before the root that leads to them is published
+		commitTreeWrite(indexFile);
+
+		//Keep the Bloom filter sidecar in step with the index. It is read
+		//again first, since other writers may have added to it
+		bloom.loaded = false;
+		if (loadBloomFilter(sidecarFileName(".bloom")))
+		{
+			for (size_t i = 0; i < keyHashes.size(); i++)
+				saveBloomBlock(sidecarFileName(".bloom"), bloomAdd(keyHashes[i]));
+		}
+	}
+
+	if (appending)
+		flock(recordFd, LOCK_UN);
+
+	return true;
+}
+
+/**************************************************************************
+* Function to add records to the write buffer. The batch is appended to
+* the write-ahead log in one sequential write; the tree is only read, to
+* turn away keys it already has. The caller holds the writer lock.
+**************************************************************************/
+inline void Index::bufferRecords(const vector<string> &records, vector<int> &results)
+{
+	vector<string> accepted;
+	vector<size_t> acceptedAt;
+
+	for (size_t i = 0; i < records.size(); i++)
+	{
+		const string &record = records[i];
+
+		//Checked now, so that the flush into the tree cannot fail on it later
+		if (metadata.recordFormat != RECORD_FORMAT_TEXT)
+		{
+			size_t skip = 0;
+			if (metadata.recordFormat == RECORD_FORMAT_COLUMNAR)
+				skip = min(record.length(), metadata.keyLength);
+
+			if (record.length() - skip > RECORD_PAGE_SIZE - 8)
+			{
+				error = "Record is too long to fit in a record page...";
+				continue;
+			}
+		}
+
+		char key[41] = {};
+		strncpy(key, record.c_str(), metadata.keyLength);
+
+		if (!keyInShard(key))
+		{
+			error = "Key belongs to another shard; insert it through the shard manifest...";
+			continue;
+		}
+
+		string bufferKey(key, metadata.keyLength);
+		size_t offset;
+
+		if (writeBuffer.count(bufferKey) > 0 || findInTree(key, offset))
+		{
+			results[i] = INSERT_DUPLICATE;
+			continue;
+		}
+
+		writeBuffer[bufferKey] = record;
+		accepted.push_back(record);
+		acceptedAt.push_back(i);
+	}
+
+	if (!appendToWriteAheadLog(accepted))
+	{
+		error = "Unable to write to the write-ahead log " + fileName + ".wal...";
+
+		for (size_t i = 0; i < accepted.size(); i++)
+		{
+			char key[41] = {};
+			strncpy(key, accepted[i].c_str(), metadata.keyLength);
+			writeBuffer.erase(string(key, metadata.keyLength));
+		}
+		return;
+	}
+
+	for (size_t i = 0; i < acceptedAt.size(); i++)
+		results[acceptedAt[i]] = INSERT_DONE;
+}
+
+/**************************************************************************
+* Function to flush the write buffer into the tree as one batch and empty
+* the write-ahead log. The buffer is in key order, so the inserts walk the
+* leaves from left to right, and each node they change is written once,
+* when the batch commits. The caller holds the writer lock.
+**************************************************************************/
+inline bool Index::flushWriteBuffer()
+{
+	if (writeBuffer.empty())
+		return true;
+
+	vector<string> records;
+	vector<int> results(writeBuffer.size(), INSERT_FAILED);
+
+	for (map<string, string>::iterator buffered = writeBuffer.begin(); buffered != writeBuffer.end(); buffered++)
+		records.push_back(buffered->second);
+
+	//Keys the tree already has were flushed by a writer that stopped before it emptied the log
+	if (!insertRecords(records, results))
+		return false;
+
+	//The log is the only copy of these records until the tree and the record file holding them are on disk
+	if (fsync(indexFd) != 0 || (recordStore.writeFd != -1 && fsync(recordStore.writeFd) != 0))
+	{
+		error = "Unable to write the index " + fileName + " to disk...";
+		return false;
+	}
+
+	//Readers in the middle of reading the log are waited for
+	walGeneration++;
+
+	char header[16];
+	memcpy(header, "BPWAL001", 8);
+	memcpy(header + 8, &walGeneration, 8);
+
+	flock(walFd, LOCK_EX);
+	bool emptied = pwrite(walFd, header, 16, 0) == 16 && ftruncate(walFd, 16) == 0;
+	flock(walFd, LOCK_UN);
+
+	if (!emptied)
+	{
+		error = "Unable to write to the write-ahead log " + fileName + ".wal...";
+		return false;
+	}
+
+	walLength = 16;
+	writeBuffer.clear();
+
+	return true;
+}
+
+/**************************************************************************
+* Function to flush the records in the write buffer into the tree now,
+* rather than once the buffer fills. The shards of a shard manifest are
+* flushed in parallel.
+**************************************************************************/
+inline bool Index::flush()
+{
+	if (!shards.empty())
+		return eachShard(&Index::flush);
+
+	if (!writable)
+	{
+		error = "Unable to open the index for writing...";
+		return false;
+	}
+
+	if (!lockWriter())
+		return false;
+
+	readMetadata(indexFile);
+	openWriteAheadLog(false);
+	readWriteAheadLog();
+
+	bool flushed = flushWriteBuffer();
+
+	flock(indexFd, LOCK_UN);
+
+	refresh();
+	return flushed;
+}
+
+/**************************************************************************
+* Function to index the lines appended to the text file since it was last
+* read, so that an index over a file another process appends to need not
+* be created again. Only the new lines are read, and they go into the
+* tree as one sorted batch. added and duplicates, if given, get the
+* number of records indexed and of lines skipped because their key was
+* taken. The shards of a shard manifest catch up in parallel.
+**************************************************************************/
+inline bool Index::catchUp(size_t *added, size_t *duplicates)
+{
+	size_t numAdded = 0;
+	size_t numDuplicates = 0;
+	bool caughtUp = true;
+
+	if (!shards.empty())
+	{
+		//Each shard reads the new lines itself and keeps those in its key range, as when it was built
+		vector<char> done(shards.size(), 0);
+		vector<size_t> addedFor(shards.size(), 0);
+		vector<size_t> duplicatesFor(shards.size(), 0);
+		vector<thread> threads;
+
+		for (size_t s = 0; s < shards.size(); s++)
+		{
+			string lowKey = s > 0 ? shardKeys[s] : "";
+			string highKey = s + 1 < shards.size() ? shardKeys[s + 1] : "";
+
+			threads.push_back(thread([=, &done, &addedFor, &duplicatesFor]() {
+				done[s] = shards[s]->catchUpRange(lowKey, highKey, addedFor[s], duplicatesFor[s]);
+			}));
+		}
+
+		for (size_t s = 0; s < shards.size(); s++)
+		{
+			threads[s].join();
+
+			if (!done[s] && caughtUp)
+			{
+				error = shards[s]->error;
+				caughtUp = false;
+			}
+
+			numAdded = numAdded + addedFor[s];
+			numDuplicates = numDuplicates + duplicatesFor[s];
+		}
+	}
+	else
+		caughtUp = catchUpRange("", "", numAdded, numDuplicates);
+
+	if (added != NULL)
+		*added = numAdded;
+	if (duplicates != NULL)
+		*duplicates = numDuplicates;
+
+	return caughtUp;
+}
+
+/**************************************************************************
+* Function to index the whole lines appended to the text file whose keys
+* are from lowKey up to, but not including, highKey. Text format records
+* are indexed where they are; binary formats copy them into the record
+* file as create() does.
+**************************************************************************/
+inline bool Index::catchUpRange(const string &lowKey, const string &highKey, size_t &added, size_t &duplicates)
+{
+	if (!writable)
+	{
+		error = "Unable to open the index for writing...";
+		return false;
+	}
+
+	if (!lockWriter())
+		return false;
+
+	readMetadata(indexFile);
+	openWriteAheadLog(false);
+	readWriteAheadLog();
+
+	//Records already buffered go into the tree first, as before any other batch
+	if (!flushWriteBuffer())
+	{
+		flock(indexFd, LOCK_UN);
+		return false;
+	}
+
+	string textFileName(metadata.textFileName, strnlen(metadata.textFileName, sizeof(metadata.textFileName)));
+	if (textFileName.empty())
+	{
+		error = "The index does not record how much of its text file it has read. Please create it again...";
+		flock(indexFd, LOCK_UN);
+		return false;
+	}
+
+	ifstream textFile(textFileName.c_str(), ios::in | ios::binary);
+	textFile.seekg(0, ios::end);
+
+	if (!textFile || (size_t)textFile.tellg() < metadata.textLength)
+	{
+		error = "The text file " + textFileName + " is missing or shorter than when it was indexed. Please create the index again...";
+		flock(indexFd, LOCK_UN);
+		return false;
+	}
+
+	//Only whole lines are read; a line still being written is left for next time.
+	//Text format records stay in the text file, so only their keys are kept
+	vector<pair<string, size_t> > order;
+	vector<string> lines;
+	vector<size_t> lineOffsets;
+	size_t textLength = metadata.textLength;
+	string line;
+
+	textFile.seekg(textLength, ios::beg);
+
+	for (; getline(textFile, line) && !textFile.eof(); textLength = textLength + line.length() + 1)
+	{
+		char key[41] = {};
+		strncpy(key, line.c_str(), metadata.keyLength);
+
+		if (!lowKey.empty() && compareKeys(key, lowKey.c_str()) < 0)
+			continue;
+		if (!highKey.empty() && compareKeys(key, highKey.c_str()) >= 0)
+			continue;
+
+		//A shard refreshed on its own leaves the lines of the other shards to them
+		if (!keyInShard(key))
+			continue;
+
+		order.push_back(make_pair(string(key, metadata.keyLength), lines.size()));
+		lines.push_back(metadata.recordFormat == RECORD_FORMAT_TEXT ? order.back().first : line);
+		lineOffsets.push_back(textLength);
+	}
+
+	if (textLength == metadata.textLength)
+	{
+		flock(indexFd, LOCK_UN);
+		return true;
+	}
+
+	//In key order the inserts walk the leaves from left to right; of lines
+	//with the same key the first one in the file is kept, as in create()
+	sort(order.begin(), order.end());
+
+	vector<string> records(order.size());
+	vector<size_t> offsets(order.size());
+	vector<int> results(order.size(), INSERT_FAILED);
+
+	for (size_t i = 0; i < order.size(); i++)
+	{
+		swap(records[i], lines[order[i].second]);
+		offsets[i] = lineOffsets[order[i].second];
+	}
+
+	size_t indexedLength = metadata.textLength;
+	metadata.textLength = textLength;
+
+	if (!insertRecords(records, results, &offsets))
+	{
+		metadata.textLength = indexedLength;
+		flock(indexFd, LOCK_UN);
+		return false;
+	}
+
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		if (results[i] == INSERT_DONE)
+			added++;
+		else if (results[i] == INSERT_DUPLICATE)
+		{
+			//A line an insert appended while the file was ahead of the index is already indexed where it is
+			size_t indexedAt;
+			if (metadata.recordFormat == RECORD_FORMAT_TEXT && findInTree(records[i].c_str(), indexedAt) && indexedAt == offsets[i])
+				continue;
+
+			duplicates++;
+		}
+	}
+
+	//With nothing new in the tree there was no commit to record how far the file was read
+	if (added == 0)
+	{
+		writeMetadata(indexFile);
+		indexFile.flush();
+	}
+
+	flock(indexFd, LOCK_UN);
+
+	refresh();
+	return true;
+}
+
+/**************************************************************************
+* Function to open the write-ahead log of the index. Unless create is
+* set, an index without one is left without one.
+**************************************************************************/
+inline void Index::openWriteAheadLog(bool create)
+{
+	if (walFd != -1)
+		return;
+
+	int flags = writable ? O_RDWR : O_RDONLY;
+	if (create && writable)
+		flags = flags | O_CREAT;
+
+	walFd = ::open(sidecarFileName(".wal"), flags, 0644);
+}
+
+/**************************************************************************
+* Function to read the write buffer of a reader from the write-ahead log
+**************************************************************************/
+inline void Index::loadWriteBuffer()
+{
+	openWriteAheadLog(false);
+
+	if (walFd == -1)
+		return;
+
+	flock(walFd, LOCK_SH);
+	readWriteAheadLog();
+	flock(walFd, LOCK_UN);
+}
+
+/**************************************************************************
+* Function to bring the write buffer up to date with the write-ahead log.
+* The log starts with a magic and a generation, which moves on each time
+* the log is flushed into the tree and emptied. Within a generation the
+* records are only appended, each as its 8 byte length and then the
+* record, so only those appended since the last read are read. A record
+* cut short by a writer still appending it, or that stopped part way, is
+* left out. Readers hold the log shared while they read it, so that it
+* is not emptied under them.
+**************************************************************************/
+inline void Index::readWriteAheadLog()
+{
+	if (walFd == -1)
+		return;
+
+	struct stat walStat;
+	if (fstat(walFd, &walStat) != 0)
+		return;
+
+	size_t fileLength = walStat.st_size;
+	size_t generation = 0;
+	char header[16];
+
+	if (fileLength >= 16 && pread(walFd, header, 16, 0) == 16 && memcmp(header, "BPWAL001", 8) == 0)
+		memcpy(&generation, header + 8, 8);
+
+	if (generation != walGeneration || walLength < 16 || walLength > fileLength)
+	{
+		writeBuffer.clear();
+		walGeneration = generation;
+		walLength = 16;
+	}
+
+	if (fileLength <= walLength)
+		return;
+
+	vector<char> log(fileLength - walLength);
+	ssize_t done = pread(walFd, &log[0], log.size(), walLength);
+	if (done <= 0)
+		return;
+
+	size_t pos = 0;
+
+	while (pos + 8 <= (size_t)done)
+	{
+		size_t length;
+		memcpy(&length, &log[pos], 8);
+
+		if (length > (size_t)done - pos - 8)
+			break;
+
+		char key[41] = {};
+		string record(&log[pos + 8], length);
+
+		strncpy(key, record.c_str(), metadata.keyLength);
+		writeBuffer[string(key, metadata.keyLength)] = record;
+
+		pos = pos + 8 + length;
+	}
+
+	walLength = walLength + pos;
+}
+
+/**************************************************************************
+* Function to append records to the write-ahead log in one write. The
+* caller holds the writer lock.
+**************************************************************************/
+inline bool Index::appendToWriteAheadLog(const vector<string> &records)
+{
+	if (records.empty())
+		return true;
+
+	if (walFd == -1)
+		return false;
+
+	struct stat walStat;
+	if (fstat(walFd, &walStat) != 0)
+		return false;
+
+	string log;
+
+	//A new log starts with its header
+	if ((size_t)walStat.st_size < 16)
+	{
+		log.append("BPWAL001", 8);
+		log.append((char*)&walGeneration, 8);
+		walLength = 0;
+	}
+
+	for (size_t i = 0; i < records.size(); i++)
+	{
+		size_t length = records[i].length();
+		log.append((char*)&length, 8);
+		log.append(records[i]);
+	}
+
+	//A record cut short by an earlier writer is dropped, so that nothing is appended after it
+	if (ftruncate(walFd, walLength) != 0 || pwrite(walFd, log.data(), log.size(), walLength) != (ssize_t)log.size())
+		return false;
+
+	//The records are only accepted once the log holding them is on disk
+	if (fdatasync(walFd) != 0)
+		return false;
+
+	walLength = walLength + log.size();
+	return true;
+}
+
+/**************************************************************************
+* Function to take the writer lock. A rebuild may have put a new index
+* file in place while this one waited, in which case the new file is
+* opened and locked instead.
+**************************************************************************/
+inline bool Index::lockWriter()
+{
+	while (true)
+	{
+		flock(indexFd, LOCK_EX);
+
+		struct stat openedStat;
+		struct stat currentStat;
+
+		if (fstat(indexFd, &openedStat) == 0 && stat(fileName.c_str(), &currentStat) == 0 &&
+			openedStat.st_dev == currentStat.st_dev && openedStat.st_ino == currentStat.st_ino)
+			return true;
+
+		flock(indexFd, LOCK_UN);
+
+		string indexFileName = fileName;
+		IndexOptions indexOptions = options;
+
+		if (!open(indexFileName, indexOptions))
+			return false;
+
+		if (!writable)
+		{
+			error = "Unable to open the index for writing...";
+			return false;
+		}
+	}
+}
+
+/**************************************************************************
+* Function to rebuild the index into a new file with full nodes and no
+* retired pages. The new file replaces the old one in a single rename;
+* readers that have the old file open carry on with it, and writers move
+* over to the new one. The shards of a shard manifest are rebuilt in
+* parallel, each on its own.
+**************************************************************************/
+inline bool Index::rebuild()
+{
+	if (!shards.empty())
+		return eachShard(&Index::rebuild);
+
+	if (!writable)
+	{
+		error = "Unable to open the index for writing...";
+		return false;
+	}
+
+	if (!lockWriter())
+		return false;
+
+	readMetadata(indexFile);
+	openWriteAheadLog(false);
+
+	readWriteAheadLog();
+
+	//Records in the write buffer go into the tree first, so that the new file has them
+	if (!flushWriteBuffer())
+	{
+		flock(indexFd, LOCK_UN);
+		return false;
+	}
+
+	Index fresh;
+	fresh.fileName = fileName + ".rebuild";
+	fresh.metadata = metadata;
+	fresh.metadata.root = 0;
+	fresh.metadata.level = 0;
+	fresh.metadata.epoch = metadata.epoch + 1;
+
+	//Rebuilding with the compressLeaves option turns an index over to compressed leaves
+	if (options.compressLeaves)
+		fresh.metadata.leafFormat = LEAF_FORMAT_COMPRESSED;
+
+	//The new file always gets block checksums, which take the last bytes of each block
+	fresh.metadata.pageChecksums = 1;
+	fresh.metadata.maxNode = (fresh.blockDataLength() - 8) / (metadata.keyLength + 8);
+
+	fresh.indexFile.open(fresh.fileName.c_str(), fstream::out | fstream::binary | fstream::trunc);
+	fresh.writeMetadata(fresh.indexFile);
+	fresh.indexFile.close();
+
+	fresh.indexFile.open(fresh.fileName.c_str(), fstream::in | fstream::out | fstream::binary);
+	if (!fresh.indexFile)
+	{
+		error = "Unable to create the index file...";
+		flock(indexFd, LOCK_UN);
+		return false;
+	}
+
+	fresh.beginTreeWrite(fresh.indexFile, false);
+
+	//Walk the leaves of the latest tree in key order, packing the entries into the new one
+	LeafCursor cursor;
+	vector<NodeEntry> leafEntries;
+	vector<NodeEntry> children;
+	size_t leafBytes = 0;
+	size_t leafPage = 0;
+	char block[1024];
+	char expanded[LEAF_BUFFER_SIZE];
+
+	size_t corruptBefore = corruptBlocks;
+	size_t leafPtr = metadata.root != 0 ? cursorSeek(cursor, indexFd, "") : 0;
+	while (leafPtr != 0 && pread(indexFd, block, 1024, leafPtr) == 1024 && blockIntact(block))
+	{
+		const char *leaf = openLeaf(block, expanded);
+
+		for (size_t numRec = 0; !isNullKey(leafEntryKey(leaf, numRec)); numRec++)
+		{
+			NodeEntry entry;
+			memset(entry.key, 0, sizeof(entry.key));
+			memcpy(entry.key, leafEntryKey(leaf, numRec), metadata.keyLength);
+			entry.pointer = leafEntryOffset(leaf, numRec);
+
+			fresh.bulkLoadEntry(fresh.indexFile, entry, leafEntries, leafBytes, children, leafPage);
+		}
+
+		leafPtr = cursorNextLeaf(cursor, indexFd);
+	}
+
+	//A block failing its checksum ends the walk early; the old file is kept rather than lose its entries
+	if (corruptBlocks != corruptBefore)
+	{
+		fresh.indexFile.close();
+		unlink(fresh.fileName.c_str());
+
+		error = "Index block failed its checksum; run -verify to find it...";
+		flock(indexFd, LOCK_UN);
+		return false;
+	}
+
+	fresh.bulkLoadFinish(fresh.indexFile, leafEntries, children, leafPage);
+	fresh.commitTreeWrite(fresh.indexFile);
+	fresh.indexFile.close();
+
+	//The free list names pages of the old file, so it goes before the new file is put in place
+	unlink(sidecarFileName(".free"));
+
+	if (rename(fresh.fileName.c_str(), fileName.c_str()) != 0)
+	{
+		error = "Unable to replace the index file...";
+		flock(indexFd, LOCK_UN);
+		return false;
+	}
+
+	flock(indexFd, LOCK_UN);
+
+	string indexFileName = fileName;
+	IndexOptions indexOptions = options;
+
+	return open(indexFileName, indexOptions);
+}
+
+/**************************************************************************
+* Function to run a step on every shard of a shard manifest in parallel.
+* Returns false if it failed on any shard, with that shard's error.
+**************************************************************************/
+inline bool Index::eachShard(bool (Index::*step)())
+{
+	vector<char> done(shards.size(), 0);
+	vector<thread> threads;
+
+	for (size_t s = 0; s < shards.size(); s++)
+	{
+		threads.push_back(thread([=, &done]() {
+			done[s] = (shards[s]->*step)();
+		}));
+	}
+
+	bool allDone = true;
+	for (size_t s = 0; s < shards.size(); s++)
+	{
+		threads[s].join();
+
+		if (!done[s] && allDone)
+		{
+			error = shards[s]->error;
+			allDone = false;
+		}
+	}
+
+	return allDone;
+}
+
+/**************************************************************************
+* Function to check an index from end to end: the checksum of every
+* block, keys ascending through every node and within the separators
+* above it, every node reached from just one parent, and every record
+* offset inside the record file. Returns false if the index could not be
+* checked; result.problems lists anything wrong with it.
+**************************************************************************/
+inline bool Index::verify(VerifyResult &result)
+{
+	result = VerifyResult();
+
+	if (shards.empty())
+		return verifyTree("", "", result);
+
+	//Each shard must also keep to its own key range
+	for (size_t s = 0; s < shards.size(); s++)
+	{
+		VerifyResult shardResult;
+		string lowKey = s > 0 ? shardKeys[s] : "";
+		string highKey = s + 1 < shards.size() ? shardKeys[s + 1] : "";
+
+		if (!shards[s]->verifyTree(lowKey, highKey, shardResult))
+		{
+			error = shards[s]->error;
+			return false;
+		}
+
+		result.blocks = result.blocks + shardResult.blocks;
+		result.keys = result.keys + shardResult.keys;
+		for (size_t i = 0; i < shardResult.problems.size(); i++)
+			result.problems.push_back(shardFileName(fileName, s) + ": " + shardResult.problems[i]);
+	}
+
+	return true;
+}
+
+/**************************************************************************
+* Function to check the tree of one index file, one level at a time. The
+* nodes of each level are split between threads, which pass the children
+* they find, with the key range each may hold, on to the next level.
+**************************************************************************/
+inline bool Index::verifyTree(const string &lowKey, const string &highKey, VerifyResult &result)
+{
+	if (recordStore.fd == -1)
+	{
+		error = "Unable to open the record file " + recordFileNameFromMetadata() + "...";
+		return false;
+	}
+
+	struct stat fileStat;
+	size_t indexLength = fstat(indexFd, &fileStat) == 0 ? fileStat.st_size : 0;
+	size_t recordLength = fstat(recordStore.fd, &fileStat) == 0 ? fileStat.st_size : 0;
+
+	//The metadata block is rewritten in place by writers, so a mismatch is read again before it counts
+	char metaBlock[1024];
+	bool metaIntact = metadata.pageChecksums == 0;
+
+	for (int attempt = 0; attempt < 2 && !metaIntact; attempt++)
+		metaIntact = pread(indexFd, metaBlock, 1024, 0) == 1024 && blockChecksumMatches(metaBlock);
+
+	result.blocks++;
+	if (!metaIntact)
+		result.problems.push_back("Metadata block fails its checksum");
+
+	if (metadata.root == 0)
+		return true;
+
+	size_t numThreads = options.verifyThreads > 0 ? options.verifyThreads : thread::hardware_concurrency();
+	if (numThreads == 0)
+		numThreads = 1;
+
+	vector<VerifyNode> nodes(1);
+	nodes[0].page = metadata.root;
+	nodes[0].lowKey = lowKey;
+	nodes[0].highKey = highKey;
+
+	set<size_t> reached;
+
+	for (size_t levelCount = 1; levelCount <= metadata.level && !nodes.empty(); levelCount++)
+	{
+		bool leaf = levelCount == metadata.level;
+
+		//A page reached twice would be checked, and its entries counted, twice
+		vector<VerifyNode> level;
+		for (size_t i = 0; i < nodes.size(); i++)
+		{
+			if (reached.insert(nodes[i].page).second)
+				level.push_back(nodes[i]);
+			else
+				result.problems.push_back("Block at " + to_string(nodes[i].page) + " is reached from more than one parent");
+		}
+
+		size_t levelThreads = min(numThreads, level.size());
+		vector<vector<VerifyNode> > childrenFor(levelThreads);
+		vector<VerifyResult> resultsFor(levelThreads);
+		vector<thread> threads;
+
+		for (size_t t = 0; t < levelThreads; t++)
+		{
+			threads.push_back(thread([=, &level, &childrenFor, &resultsFor]() {
+				for (size_t i = level.size() * t / levelThreads; i < level.size() * (t + 1) / levelThreads; i++)
+					verifyNode(level[i], leaf, indexLength, recordLength, childrenFor[t], resultsFor[t]);
+			}));
+		}
+
+		nodes.clear();
+		for (size_t t = 0; t < levelThreads; t++)
+		{
+			threads[t].join();
+
+			nodes.insert(nodes.end(), childrenFor[t].begin(), childrenFor[t].end());
+			result.blocks = result.blocks + resultsFor[t].blocks;
+			result.keys = result.keys + resultsFor[t].keys;
+			result.problems.insert(result.problems.end(), resultsFor[t].problems.begin(), resultsFor[t].problems.end());
+		}
+	}
+
+	return true;
+}
+
+/**************************************************************************
+* Function to check one node of the tree. The children of an internal
+* node are added to children with the key range each may hold.
+**************************************************************************/
+inline void Index::verifyNode(const VerifyNode &node, bool leaf, size_t indexLength, size_t recordLength, vector<VerifyNode> &children, VerifyResult &result)
+{
+	string where = "Block at " + to_string(node.page);
+	char block[1024];
+
+	result.blocks++;
+
+	if (node.page == 0 || node.page % 1024 != 0 || node.page + 1024 > indexLength || pread(indexFd, block, 1024, node.page) != 1024)
+	{
+		result.problems.push_back(where + " is outside the index file");
+		return;
+	}
+
+	//Nothing in a block that fails its checksum can be trusted, so the blocks below it are not followed
+	if (metadata.pageChecksums != 0 && !blockChecksumMatches(block))
+	{
+		result.problems.push_back(where + " fails its checksum");
+		return;
+	}
+
+	size_t link;
+	vector<NodeEntry> entries;
+	decodeNode(block, leaf, link, entries);
+
+	if (entries.size() > (leaf ? leafCapacity() : metadata.maxNode - 1))
+	{
+		result.problems.push_back(where + " has no NULL key ending it");
+		return;
+	}
+
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		const char *key = entries[i].key;
+		string keyText(key, strnlen(key, metadata.keyLength));
+
+		if (i > 0 && compareKeys(entries[i - 1].key, key) >= 0)
+			result.problems.push_back(where + " has key " + keyText + " out of order");
+
+		if ((!node.lowKey.empty() && compareKeys(key, node.lowKey.c_str()) < 0) || (!node.highKey.empty() && compareKeys(key, node.highKey.c_str()) >= 0))
+			result.problems.push_back(where + " has key " + keyText + " outside the separators above it");
+
+		if (!leaf)
+			continue;
+
+		result.keys++;
+
+		size_t offset = entries[i].pointer;
+		bool inRecordFile = metadata.recordFormat == RECORD_FORMAT_TEXT ? offset < recordLength : ((offset >> RECORD_SLOT_BITS) + 1) * RECORD_PAGE_SIZE <= recordLength;
+
+		if (!inRecordFile)
+			result.problems.push_back(where + " has key " + keyText + " with record offset " + to_string(offset) + " past the end of the record file");
+	}
+
+	if (leaf)
+		return;
+
+	//Child i holds the keys from separator i up to separator i + 1
+	for (size_t i = 0; i <= entries.size(); i++)
+	{
+		VerifyNode child;
+		child.page = i == 0 ? link : entries[i - 1].pointer;
+		child.lowKey = i == 0 ? node.lowKey : string(entries[i - 1].key, metadata.keyLength);
+		child.highKey = i == entries.size() ? node.highKey : string(entries[i].key, metadata.keyLength);
+		children.push_back(child);
+	}
+}
+
+/**************************************************************************
+* Function to get the number of block reads that failed their checksum,
+* over every shard
+**************************************************************************/
+inline size_t Index::corruptBlockCount() const
+{
+	size_t count = corruptBlocks;
+
+	for (size_t s = 0; s < shards.size(); s++)
+		count = count + shards[s]->corruptBlockCount();
+
+	return count;
+}
+
+/**************************************************************************
+* Function to add the next entry, in key order, to a tree being loaded
+* bottom up. Leaves are filled as far as they go; each full leaf is
+* written once the page of the leaf after it is known. leafBytes keeps
+* the size of a compressed leaf being filled. children collects the
+* first key and page of every leaf.
+**************************************************************************/
+inline void Index::bulkLoadEntry(fstream &indexFile, const NodeEntry &entry, vector<NodeEntry> &leafEntries, size_t &leafBytes, vector<NodeEntry> &children, size_t &leafPage)
+{
+	char block[1024];
+
+	size_t entryBytes = 0;
+	bool full = leafEntries.size() == leafCapacity();
+
+	if (metadata.leafFormat == LEAF_FORMAT_COMPRESSED)
+	{
+		entryBytes = packedEntrySize(leafEntries.empty() ? NULL : &leafEntries.back(), entry);
+		full = full || leafBytes + entryBytes > blockDataLength();
+	}
+
+	if (full)
+	{
+		size_t nextPage = allocatePage();
+
+		encodeNode(block, true, nextPage, leafEntries);
+		writeBlock(indexFile, leafPage, block);
+
+		NodeEntry child = leafEntries[0];
+		child.pointer = leafPage;
+		children.push_back(child);
+
+		leafEntries.clear();
+		leafPage = nextPage;
+		entryBytes = packedEntrySize(NULL, entry);
+	}
+
+	if (leafEntries.empty())
+	{
+		leafBytes = 10;
+		if (leafPage == 0)
+			leafPage = allocatePage();
+	}
+
+	leafEntries.push_back(entry);
+	leafBytes = leafBytes + entryBytes;
+}
+
+/**************************************************************************
+* Function to finish a tree loaded bottom up: the last leaf is written,
+* then each level of internal nodes over the one below, until a single
+* node is left as the root
+**************************************************************************/
+inline void Index::bulkLoadFinish(fstream &indexFile, vector<NodeEntry> &leafEntries, vector<NodeEntry> &children, size_t &leafPage)
+{
+	char block[1024];
+
+	if (!leafEntries.empty())
+	{
+		encodeNode(block, true, 0, leafEntries);
+		writeBlock(indexFile, leafPage, block);
+
+		NodeEntry child = leafEntries[0];
+		child.pointer = leafPage;
+		children.push_back(child);
+	}
+
+	if (children.empty())
+		return;
+
+	metadata.level = 1;
+
+	while (children.size() > 1)
+	{
+		vector<NodeEntry> parents;
+
+		for (size_t first = 0; first < children.size(); first = first + metadata.maxNode)
+		{
+			size_t last = min(first + metadata.maxNode, children.size());
+			vector<NodeEntry> entries(children.begin() + first + 1, children.begin() + last);
+
+			NodeEntry parent = children[first];
+			parent.pointer = allocatePage();
+
+			encodeNode(block, false, children[first].pointer, entries);
+			writeBlock(indexFile, parent.pointer, block);
+
+			parents.push_back(parent);
+		}
+
+		children.swap(parents);
+		metadata.level++;
+	}
+
+	metadata.root = children[0].pointer;
+}
+
+/**************************************************************************
+* Function to map the index for in-memory lookups. The mapping is made
+* again once the snapshot has moved on, since the file may have grown.
+**************************************************************************/
+inline bool Index::mapIndex()
+{
+	if (mappedIndex != NULL && mappedEpoch == metadata.epoch)
+		return true;
+
+	if (mappedIndex != NULL)
+		munmap((void*)mappedIndex, mappedLength);
+
+	mappedIndex = mapIndexFile(fileName, mappedLength);
+	mappedEpoch = metadata.epoch;
+
+	return mappedIndex != NULL;
+}
+
+/**************************************************************************
+* Function to read the record at an offset. Text records are read up to
+* the end of their line; binary records are copied out as stored, behind
+* the key from the index when the record file holds payloads only.
+**************************************************************************/
+inline bool Index::readRecord(size_t offset, const char *key, string &record)
+{
+	record.clear();
+
+	if (metadata.recordFormat == RECORD_FORMAT_TEXT)
+	{
+		char chunk[TEXT_RECORD_READ];
+
+		while (true)
+		{
+			ssize_t result = pread(recordStore.fd, chunk, TEXT_RECORD_READ, offset + record.length());
+			if (result < 0)
+				return false;
+
+			const char *newline = (const char*)memchr(chunk, '\n', result);
+			record.append(chunk, newline != NULL ? newline - chunk : result);
+
+			if (newline != NULL || result < (ssize_t)TEXT_RECORD_READ)
+				return true;
+		}
+	}
+
+	const char *data;
+	size_t length;
+
+	if (!fetchBinaryRecord(offset, data, length))
+		return false;
+
+	if (metadata.recordFormat == RECORD_FORMAT_COLUMNAR)
+		record.assign(key, metadata.keyLength);
+
+	record.append(data, length);
+	return true;
+}
+
+/**************************************************************************
+* Function to get a record out of a finished read. A text line longer
+* than the chunk read, or a columnar record that needs its key put back,
+* is built in overflow.
+**************************************************************************/
+inline bool Index::recordFromRead(ReadRequest &request, size_t offset, const char *key, RecordView &view, string &overflow)
+{
+	size_t length = request.result > 0 ? request.result : 0;
+
+	if (metadata.recordFormat == RECORD_FORMAT_TEXT)
+	{
+		const char *newline = (const char*)memchr(request.buffer, '\n', length);
+
+		if (newline == NULL && length == request.length)
+		{
+			if (!readRecord(offset, key, overflow))
+				return false;
+
+			view.data = overflow.data();
+			view.length = overflow.length();
+			return true;
+		}
+
+		view.data = request.buffer;
+		view.length = newline != NULL ? newline - request.buffer : length;
+		return true;
+	}
+
+	const char *data;
+	size_t slot = offset & (((size_t)1 << RECORD_SLOT_BITS) - 1);
+
+	if (length < RECORD_PAGE_SIZE || !recordInPage(request.buffer, slot, data, length))
+		return false;
+
+	if (metadata.recordFormat == RECORD_FORMAT_COLUMNAR)
+	{
+		overflow.assign(key, metadata.keyLength);
+		overflow.append(data, length);
+		data = overflow.data();
+		length = overflow.length();
+	}
+
+	view.data = data;
+	view.length = length;
+	return true;
+}
+
+/**************************************************************************
+* Functions to read and write one index block
+**************************************************************************/
+inline void Index::readBlock(fstream &indexFile, size_t offsetPtr, char block[])
+{
+	char *dirtyBlock = findDirtyBlock(offsetPtr, false);
+	if (dirtyBlock != NULL)
+	{
+		memcpy(block, dirtyBlock, 1024);
+		return;
+	}
+
+	indexFile.seekg(offsetPtr, ios::beg);
+	indexFile.read(block, 1024);
+}
+
+inline void Index::writeBlock(fstream &indexFile, size_t offsetPtr, const char block[])
+{
+	char sealed[1024];
+	memcpy(sealed, block, 1024);
+	sealBlock(sealed);
+
+	//Under copy on write no reader can reach the page yet, so the node can wait
+	//for the commit; a node changed by many inserts of a batch is written once
+	if (treeWriter.copyOnWrite)
+	{
+		memcpy(findDirtyBlock(offsetPtr, true), sealed, 1024);
+		return;
+	}
+
+	indexFile.seekp(offsetPtr, ios::beg);
+	indexFile.write(sealed, 1024);
+}
+
+/**************************************************************************
+* Function to find the copy of a node held back for the commit. With add,
+* a page that has none gets the next block of dirtyBlocks, which is kept
+* from one write to the next. Returns NULL if there is none; the block
+* is only valid until the next one is added.
+**************************************************************************/
+inline char *Index::findDirtyBlock(size_t offsetPtr, bool add)
+{
+	vector<pair<size_t, size_t> > &dirty = treeWriter.dirty;
+	vector<pair<size_t, size_t> >::iterator found = lower_bound(dirty.begin(), dirty.end(), make_pair(offsetPtr, (size_t)0));
+
+	if (found != dirty.end() && found->first == offsetPtr)
+		return &treeWriter.dirtyBlocks[found->second * 1024];
+
+	if (!add)
+		return NULL;
+
+	//New pages come from the end of the file, so this is nearly always an append
+	size_t block = dirty.size();
+	dirty.insert(found, make_pair(offsetPtr, block));
+
+	if (treeWriter.dirtyBlocks.size() < dirty.size() * 1024)
+		treeWriter.dirtyBlocks.resize(dirty.size() * 1024);
+
+	return &treeWriter.dirtyBlocks[block * 1024];
+}
+
+/**************************************************************************
+* Function to get the bytes of a block that nodes may use, which is all
+* of it unless the block ends with its checksum
+**************************************************************************/
+inline size_t Index::blockDataLength()
+{
+	return metadata.pageChecksums != 0 ? BLOCK_CHECKSUM_OFFSET : 1024;
+}
+
+/**************************************************************************
+* Function to put the checksum at the end of a block about to be written
+**************************************************************************/
+inline void Index::sealBlock(char block[])
+{
+	if (metadata.pageChecksums == 0)
+		return;
+
+	uint32_t checksum = crc32c(block, BLOCK_CHECKSUM_OFFSET);
+	memcpy(&block[BLOCK_CHECKSUM_OFFSET], &checksum, 4);
+}
+
+/**************************************************************************
+* Function to check a block a reader has read, when readers verify
+* checksums. A block that fails is counted and treated as unreadable.
+**************************************************************************/
+inline bool Index::blockIntact(const char block[])
+{
+	if (!options.verifyChecksums || metadata.pageChecksums == 0 || blockChecksumMatches(block))
+		return true;
+
+	corruptBlocks++;
+	return false;
+}
+
+/**************************************************************************
+* Function to unpack a node block into its entries. For a leaf, link is
+* the pointer to the next leaf and each entry holds a record offset. For an
+* internal node, link is the leftmost child and each entry holds the child
+* to the right of its key.
+**************************************************************************/
+inline void Index::decodeNode(const char block[], bool leaf, size_t &link, vector<NodeEntry> &entries)
+{
+	size_t pos = leaf ? 0 : 8;
+	size_t maxEntries = leaf ? leafCapacity() : metadata.maxNode - 1;
+	char expanded[LEAF_BUFFER_SIZE];
+
+	entries.clear();
+	link = 0;
+
+	if (leaf)
+		block = openLeaf(block, expanded);
+	else
+		memcpy((char*)&link, &block[0], 8);
+
+	for (size_t count = 0; count <= maxEntries; count++)
+	{
+		if (isNullKey(&block[pos]))
+		{
+			if (leaf)
+				memcpy((char*)&link, &block[pos + metadata.keyLength], 8);
+			return;
+		}
+
+		NodeEntry entry;
+		memset(entry.key, 0, sizeof(entry.key));
+		memcpy(entry.key, &block[pos], metadata.keyLength);
+		memcpy((char*)&entry.pointer, &block[pos + metadata.keyLength], 8);
+		entries.push_back(entry);
+
+		pos = pos + metadata.keyLength + 8;
+	}
+}
+
+/**************************************************************************
+* Function to pack entries into a node block, ending with the NULL key
+**************************************************************************/
+inline void Index::encodeNode(char block[], bool leaf, size_t link, const vector<NodeEntry> &entries)
+{
+	size_t pos = leaf ? 0 : 8;
+
+	if (leaf && metadata.leafFormat == LEAF_FORMAT_COMPRESSED)
+	{
+		packLeaf(block, link, entries);
+		return;
+	}
+
+	memset(block, ' ', 1024);
+
+	if (!leaf)
+		memcpy(&block[0], (char*)&link, 8);
+
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		memcpy(&block[pos], entries[i].key, metadata.keyLength);
+		memcpy(&block[pos + metadata.keyLength], (char*)&entries[i].pointer, 8);
+		pos = pos + metadata.keyLength + 8;
+	}
+
+	memcpy(&block[pos], nullKey, metadata.keyLength);
+	memcpy(&block[pos + metadata.keyLength], leaf ? (const char*)&link : (const char*)&nullOffset, 8);
+}
+
+/**************************************************************************
+* Function to get the most entries a leaf can hold
+**************************************************************************/
+inline size_t Index::leafCapacity()
+{
+	if (metadata.leafFormat == LEAF_FORMAT_COMPRESSED)
+		return 4 * metadata.maxNode - 1;
+
+	return metadata.maxNode - 1;
+}
+
+/**************************************************************************
+* Function to get the bytes an entry takes in a compressed leaf, after
+* the entry before it, if any. The key is front coded: a byte for the
+* length of the prefix it shares with the key before, then the rest of
+* it. The record offset is the difference from the offset before, zigzag
+* coded so that small steps either way are small, in 7 bit groups.
+**************************************************************************/
+inline size_t Index::packedEntrySize(const NodeEntry *previous, const NodeEntry &entry)
+{
+	size_t shared = 0;
+	size_t delta = entry.pointer;
+
+	if (previous != NULL)
+	{
+		while (shared < metadata.keyLength && entry.key[shared] == previous->key[shared])
+			shared++;
+
+		delta = entry.pointer - previous->pointer;
+	}
+
+	delta = (delta << 1) ^ (size_t)((int64_t)delta >> 63);
+
+	size_t size = 1 + metadata.keyLength - shared + 1;
+	for (; delta >= 0x80; delta = delta >> 7)
+		size++;
+
+	return size;
+}
+
+/**************************************************************************
+* Function to write a compressed leaf block: the entry count in 2 bytes
+* and the next leaf link in 8, then the entries. Returns false if they
+* do not fit in the block.
+**************************************************************************/
+inline bool Index::packLeaf(char block[], size_t link, const vector<NodeEntry> &entries)
+{
+	memset(block, 0, 1024);
+
+	if (entries.size() > leafCapacity())
+		return false;
+
+	uint16_t count = entries.size();
+	memcpy(&block[0], (char*)&count, 2);
+	memcpy(&block[2], (char*)&link, 8);
+
+	size_t pos = 10;
+
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		const NodeEntry *previous = i > 0 ? &entries[i - 1] : NULL;
+
+		if (pos + packedEntrySize(previous, entries[i]) > blockDataLength())
+			return false;
+
+		size_t shared = 0;
+		size_t delta = entries[i].pointer;
+
+		if (previous != NULL)
+		{
+			while (shared < metadata.keyLength && entries[i].key[shared] == previous->key[shared])
+				shared++;
+
+			delta = entries[i].pointer - previous->pointer;
+		}
+
+		delta = (delta << 1) ^ (size_t)((int64_t)delta >> 63);
+
+		block[pos++] = (char)shared;
+		memcpy(&block[pos], &entries[i].key[shared], metadata.keyLength - shared);
+		pos = pos + metadata.keyLength - shared;
+
+		for (; delta >= 0x80; delta = delta >> 7)
+			block[pos++] = (char)(delta | 0x80);
+		block[pos++] = (char)delta;
+	}
+
+	return true;
+}
+
+/**************************************************************************
+* Function to pick where an overfull compressed leaf splits: where half
+* of its bytes are on each side, so both halves fit whatever the sizes of
+* their entries
+**************************************************************************/
+inline size_t Index::packedSplitPoint(const vector<NodeEntry> &entries)
+{
+	vector<size_t> sizes(entries.size());
+	size_t total = 0;
+
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		sizes[i] = packedEntrySize(i > 0 ? &entries[i - 1] : NULL, entries[i]);
+		total = total + sizes[i];
+	}
+
+	size_t half = 1;
+	size_t bytes = sizes[0];
+
+	while (half + 1 < entries.size() && bytes + sizes[half] <= total / 2)
+	{
+		bytes = bytes + sizes[half];
+		half++;
+	}
+
+	return half;
+}
+
+/**************************************************************************
+* Function to expand a leaf block into the plain layout, which leafEntryKey
+* and the other leaf functions read. The keys are rebuilt one from the
+* next, and the offsets by adding up their differences.
+**************************************************************************/
+inline void Index::expandLeaf(const char block[], char leaf[])
+{
+	if (metadata.leafFormat != LEAF_FORMAT_COMPRESSED)
+	{
+		memcpy(leaf, block, 1024);
+		return;
+	}
+
+	uint16_t count;
+	size_t link;
+	memcpy((char*)&count, &block[0], 2);
+	memcpy((char*)&link, &block[2], 8);
+
+	size_t keyLength = metadata.keyLength;
+	size_t entrySize = keyLength + 8;
+	size_t numEntries = min((size_t)count, leafCapacity());
+	size_t pos = 10;
+	size_t offset = 0;
+	char *entry = leaf;
+
+	for (size_t i = 0; i < numEntries && pos < 1024; i++)
+	{
+		size_t shared = min((size_t)(unsigned char)block[pos++], keyLength);
+
+		if (pos + keyLength - shared >= 1024)
+			break;
+
+		if (i > 0)
+			memcpy(entry, entry - entrySize, shared);
+		memcpy(entry + shared, &block[pos], keyLength - shared);
+		pos = pos + keyLength - shared;
+
+		size_t delta = 0;
+		for (size_t shift = 0; shift < 64 && pos < 1024; shift = shift + 7)
+		{
+			unsigned char byte = block[pos++];
+			delta = delta | ((size_t)(byte & 0x7f) << shift);
+			if ((byte & 0x80) == 0)
+				break;
+		}
+
+		offset = offset + ((delta >> 1) ^ (0 - (delta & 1)));
+		memcpy(entry + keyLength, (char*)&offset, 8);
+
+		entry = entry + entrySize;
+	}
+
+	memcpy(entry, nullKey, keyLength);
+	memcpy(entry + keyLength, (char*)&link, 8);
+}
+
+/**************************************************************************
+* Function to get a leaf block in the plain layout. Plain leaves are used
+* where they are; compressed ones are expanded into expanded.
+**************************************************************************/
+inline const char *Index::openLeaf(const char block[], char expanded[])
+{
+	if (metadata.leafFormat != LEAF_FORMAT_COMPRESSED)
+		return block;
+
+	expandLeaf(block, expanded);
+	return expanded;
+}
+
+/**************************************************************************
+* Function to get a page for a new node block. Retired pages that no
+* reader can reach any more are used before the file is grown.
+**************************************************************************/
+inline size_t Index::allocatePage()
+{
+	size_t offsetPtr;
+
+	if (!treeWriter.reusable.empty())
+	{
+		offsetPtr = treeWriter.reusable.back();
+		treeWriter.reusable.pop_back();
+	}
+	else
+	{
+		offsetPtr = treeWriter.fileEnd;
+		treeWriter.fileEnd = treeWriter.fileEnd + 1024;
+	}
+
+	treeWriter.fresh.insert(upper_bound(treeWriter.fresh.begin(), treeWriter.fresh.end(), offsetPtr), offsetPtr);
+	return offsetPtr;
+}
+
+/**************************************************************************
+* Function to pick where a changed node is written. Without copy on write,
+* or for a page this write allocated itself, that is where it already is.
+* Otherwise a reader may still be using the page, so it is retired and
+* the node is written to a new page.
+**************************************************************************/
+inline size_t Index::pageForChangedNode(size_t offsetPtr)
+{
+	if (!treeWriter.copyOnWrite || binary_search(treeWriter.fresh.begin(), treeWriter.fresh.end(), offsetPtr))
+		return offsetPtr;
+
+	treeWriter.retired.push_back(offsetPtr);
+	return allocatePage();
+}
+
+/**************************************************************************
+* Function to write a changed node, splitting it in two if it is over
+* capacity. leftPage is where the node (or its left half) went; rightPage
+* is the new right half, or 0 if there was no split, and separator holds
+* the key that goes up to the parent for it.
+**************************************************************************/
+inline void Index::writeNodeSplit(fstream &indexFile, bool leaf, size_t offsetPtr, size_t link, vector<NodeEntry> &entries, size_t &leftPage, size_t &rightPage, NodeEntry &separator)
+{
+	char block[1024];
+
+	rightPage = 0;
+
+	bool packed = leaf && metadata.leafFormat == LEAF_FORMAT_COMPRESSED;
+
+	if (packed ? packLeaf(block, link, entries) : entries.size() < metadata.maxNode)
+	{
+		leftPage = pageForChangedNode(offsetPtr);
+		encodeNode(block, leaf, link, entries);
+		writeBlock(indexFile, leftPage, block);
+		return;
+	}
+
+	size_t half = (entries.size() + 1) / 2;
+	vector<NodeEntry> &rightEntries = treeWriter.rightEntries;
+
+	if (packed)
+		half = packedSplitPoint(entries);
+	size_t rightLink;
+
+	leftPage = pageForChangedNode(offsetPtr);
+	rightPage = allocatePage();
+
+	if (leaf)
+	{
+		//Leaves keep every key; the first key of the right leaf is copied up
+		rightEntries.assign(entries.begin() + half, entries.end());
+		rightLink = link;
+		link = rightPage;
+		separator = rightEntries[0];
+	}
+	else
+	{
+		//Internal nodes move their middle key up to the parent
+		separator = entries[half];
+		rightEntries.assign(entries.begin() + half + 1, entries.end());
+		rightLink = entries[half].pointer;
+	}
+
+	entries.resize(half);
+
+	encodeNode(block, leaf, rightLink, rightEntries);
+	writeBlock(indexFile, rightPage, block);
+
+	encodeNode(block, leaf, link, entries);
+	writeBlock(indexFile, leftPage, block);
+}
+
+/**************************************************************************
+* Function to insert a key into the B+ tree index. The path from the root
+* to the leaf is remembered on the way down; the leaf change and any
+* splits are then carried back up it. Returns 1 if the key already exists.
+**************************************************************************/
+inline int Index::insertIntoTree(fstream &indexFile, const char *key, size_t offset)
+{
+	char block[1024];
+	size_t link;
+	vector<NodeEntry> &entries = treeWriter.entries;
+
+	NodeEntry entry;
+	memset(entry.key, 0, sizeof(entry.key));
+	memcpy(entry.key, key, metadata.keyLength);
+	entry.pointer = offset;
+
+	//First key; the root starts out as a leaf
+	if (metadata.root == 0)
+	{
+		entries.assign(1, entry);
+		metadata.root = allocatePage();
+		metadata.level = 1;
+
+		encodeNode(block, true, 0, entries);
+		writeBlock(indexFile, metadata.root, block);
+		return 0;
+	}
+
+	vector<size_t> &pathNodes = treeWriter.pathNodes;
+	vector<size_t> &pathPositions = treeWriter.pathPositions;
+	size_t node = metadata.root;
+
+	pathNodes.clear();
+	pathPositions.clear();
+
+	for (size_t levelCount = 1; levelCount < metadata.level; levelCount++)
+	{
+		readBlock(indexFile, node, block);
+
+		size_t pos = childPosition(block, entry.key);
+		pathNodes.push_back(node);
+		pathPositions.push_back(pos);
+
+		node = internalChild(block, pos);
+	}
+
+	//Place the key in the leaf
+	readBlock(indexFile, node, block);
+	decodeNode(block, true, link, entries);
+
+	size_t numRec = 0;
+	while (numRec < entries.size() && compareKeys(entries[numRec].key, entry.key) < 0)
+		numRec++;
+
+	if (numRec < entries.size() && compareKeys(entries[numRec].key, entry.key) == 0)
+		return 1;
+
+	entries.insert(entries.begin() + numRec, entry);
+
+	size_t leftPage;
+	size_t rightPage;
+	NodeEntry separator;
+
+	writeNodeSplit(indexFile, true, node, link, entries, leftPage, rightPage, separator);
+
+	//Carry the change up the path until a node stays where it was and did not split
+	bool rootChanged = true;
+	size_t child = node;
+
+	for (size_t i = pathNodes.size(); i-- > 0; )
+	{
+		if (rightPage == 0 && leftPage == child)
+		{
+			rootChanged = false;
+			break;
+		}
+
+		readBlock(indexFile, pathNodes[i], block);
+		decodeNode(block, false, link, entries);
+
+		size_t pos = pathPositions[i];
+		if (pos == 0)
+			link = leftPage;
+		else
+			entries[pos - 1].pointer = leftPage;
+
+		if (rightPage != 0)
+		{
+			separator.pointer = rightPage;
+			entries.insert(entries.begin() + pos, separator);
+		}
+
+		child = pathNodes[i];
+		writeNodeSplit(indexFile, false, child, link, entries, leftPage, rightPage, separator);
+	}
+
+	if (!rootChanged)
+		return 0;
+
+	if (rightPage != 0)		//The root split, so the tree grows a level
+	{
+		separator.pointer = rightPage;
+		entries.assign(1, separator);
+
+		metadata.root = allocatePage();
+		metadata.level++;
+
+		encodeNode(block, false, leftPage, entries);
+		writeBlock(indexFile, metadata.root, block);
+	}
+	else
+		metadata.root = leftPage;
+
+	return 0;
+}
+
+/**************************************************************************
+* Function to start a batch of changes to the tree. With copy on write,
+* no page a reader can reach is changed; the free list is loaded and the
+* retired pages older than every pinned reader become reusable.
+**************************************************************************/
+inline void Index::beginTreeWrite(fstream &indexFile, bool copyOnWrite)
+{
+	treeWriter.copyOnWrite = copyOnWrite;
+	treeWriter.reusable.clear();
+	treeWriter.freePages.clear();
+	treeWriter.retired.clear();
+	treeWriter.fresh.clear();
+	treeWriter.dirty.clear();
+
+	indexFile.seekg(0, ios::end);
+	size_t fileEnd = indexFile.tellg();
+	treeWriter.fileEnd = (fileEnd + 1023) / 1024 * 1024;
+	if (treeWriter.fileEnd < 1024)
+		treeWriter.fileEnd = 1024;
+
+	//Room for an insert that splits every node on its path and grows a new
+	//root, so that the first split or new level does not have to allocate
+	size_t splitPages = 2 * INSERT_RESERVE_LEVELS + 1;
+	size_t leafEntries = 4 * metadata.maxNode + 2;
+
+	treeWriter.pathNodes.reserve(INSERT_RESERVE_LEVELS);
+	treeWriter.pathPositions.reserve(INSERT_RESERVE_LEVELS);
+	treeWriter.retired.reserve(splitPages);
+	treeWriter.fresh.reserve(splitPages);
+	treeWriter.dirty.reserve(splitPages);
+	if (treeWriter.dirtyBlocks.size() < splitPages * 1024)
+		treeWriter.dirtyBlocks.resize(splitPages * 1024);
+	treeWriter.entries.reserve(leafEntries);
+	treeWriter.rightEntries.reserve(leafEntries);
+
+	if (!copyOnWrite)
+		return;
+
+	size_t oldestEpoch = oldestPinnedEpoch();
+
+	//The list is read in one go into the vector kept from the last write
+	int freeFd = ::open(sidecarFileName(".free"), O_RDONLY);
+	struct stat freeStat;
+
+	if (freeFd == -1)
+		return;
+
+	if (fstat(freeFd, &freeStat) == 0)
+	{
+		//The commit adds at most the pages this write retires; the room is doubled as the list grows
+		size_t listPages = freeStat.st_size / sizeof(FreePage);
+		if (treeWriter.freePages.capacity() < listPages + splitPages)
+		{
+			treeWriter.freePages.reserve(2 * (listPages + splitPages));
+			treeWriter.reusable.reserve(2 * (listPages + splitPages));
+		}
+
+		treeWriter.freePages.resize(listPages);
+	}
+
+	size_t listBytes = treeWriter.freePages.size() * sizeof(FreePage);
+	if (listBytes > 0 && pread(freeFd, &treeWriter.freePages[0], listBytes, 0) != (ssize_t)listBytes)
+		treeWriter.freePages.clear();
+
+	::close(freeFd);
+
+	size_t kept = 0;
+	for (size_t i = 0; i < treeWriter.freePages.size(); i++)
+	{
+		if (treeWriter.freePages[i].epoch <= oldestEpoch)
+			treeWriter.reusable.push_back(treeWriter.freePages[i].offset);
+		else
+			treeWriter.freePages[kept++] = treeWriter.freePages[i];
+	}
+
+	treeWriter.freePages.resize(kept);
+}
+
+/**************************************************************************
+* Function to make the changes visible. The new pages are written out
+* before the metadata block that points at them; with copy on write the
+* epoch moves on and the replaced pages join the free list under it.
+**************************************************************************/
+inline void Index::commitTreeWrite(fstream &indexFile)
+{
+	for (size_t i = 0; i < treeWriter.dirty.size(); i++)
+	{
+		indexFile.seekp(treeWriter.dirty[i].first, ios::beg);
+		indexFile.write(&treeWriter.dirtyBlocks[treeWriter.dirty[i].second * 1024], 1024);
+	}
+	treeWriter.dirty.clear();
+
+	indexFile.flush();
+
+	if (treeWriter.copyOnWrite)
+		metadata.epoch++;
+
+	writeMetadata(indexFile);
+	indexFile.flush();
+
+	if (!treeWriter.copyOnWrite)
+		return;
+
+	for (size_t i = 0; i < treeWriter.retired.size(); i++)
+	{
+		FreePage page;
+		page.offset = treeWriter.retired[i];
+		page.epoch = metadata.epoch;
+		treeWriter.freePages.push_back(page);
+	}
+
+	for (size_t i = 0; i < treeWriter.reusable.size(); i++)
+	{
+		FreePage page;
+		page.offset = treeWriter.reusable[i];
+		page.epoch = 0;
+		treeWriter.freePages.push_back(page);
+	}
+
+	int freeFd = ::open(sidecarFileName(".free"), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (freeFd == -1)
+		return;
+
+	if (!treeWriter.freePages.empty())
+		write(freeFd, &treeWriter.freePages[0], treeWriter.freePages.size() * sizeof(FreePage));
+
+	::close(freeFd);
+}
+
+/**************************************************************************
+* Function to read the root, level and epoch so that they belong together.
+* A writer may be replacing the metadata block, so it is read until two
+* reads agree.
+**************************************************************************/
+inline void Index::readStableMetadata(fstream &indexFile)
+{
+	while (true)
+	{
+		readMetadata(indexFile);
+		Metadata first = metadata;
+
+		readMetadata(indexFile);
+		if (first.root == metadata.root && first.level == metadata.level && first.epoch == metadata.epoch)
+			return;
+	}
+}
+
+/**************************************************************************
+* Function to pin the current root for a reader. The reader takes a slot
+* in the readers file (index name + .readers) holding its process id and
+* epoch; writers will not reuse any page that epoch can still reach.
+**************************************************************************/
+inline void Index::pinSnapshot(fstream &indexFile)
+{
+	readerPin.fd = ::open(sidecarFileName(".readers"), O_RDWR | O_CREAT, 0644);
+	if (readerPin.fd == -1)		//Read only directory; nothing can be writing either
+	{
+		readStableMetadata(indexFile);
+		return;
+	}
+
+	flock(readerPin.fd, LOCK_EX);
+
+	readStableMetadata(indexFile);
+
+	ReaderSlot slots[READER_SLOTS] = {};
+	pread(readerPin.fd, slots, sizeof(slots), 0);
+
+	for (readerPin.slot = 0; readerPin.slot < READER_SLOTS; readerPin.slot++)
+	{
+		ReaderSlot &slot = slots[readerPin.slot];
+		if (slot.pid == 0 || (kill(slot.pid, 0) == -1 && errno == ESRCH))
+			break;
+	}
+
+	if (readerPin.slot < READER_SLOTS)
+	{
+		ReaderSlot slot;
+		slot.pid = getpid();
+		slot.epoch = metadata.epoch;
+		pwrite(readerPin.fd, &slot, sizeof(slot), readerPin.slot * sizeof(slot));
+	}
+
+	flock(readerPin.fd, LOCK_UN);
+}
+
+/**************************************************************************
+* Function to release the reader's slot
+**************************************************************************/
+inline void Index::unpinSnapshot()
+{
+	if (readerPin.fd == -1)
+		return;
+
+	if (readerPin.slot < READER_SLOTS)
+	{
+		ReaderSlot slot = {};
+
+		flock(readerPin.fd, LOCK_EX);
+		pwrite(readerPin.fd, &slot, sizeof(slot), readerPin.slot * sizeof(slot));
+		flock(readerPin.fd, LOCK_UN);
+	}
+
+	::close(readerPin.fd);
+	readerPin.fd = -1;
+}
+
+/**************************************************************************
+* Function to find the oldest epoch pinned by a live reader. Slots left by
+* readers that have exited are cleared on the way.
+**************************************************************************/
+inline size_t Index::oldestPinnedEpoch()
+{
+	size_t oldestEpoch = (size_t)-1;
+
+	int fd = ::open(sidecarFileName(".readers"), O_RDWR);
+	if (fd == -1)
+		return oldestEpoch;
+
+	flock(fd, LOCK_EX);
+
+	ReaderSlot slots[READER_SLOTS] = {};
+	pread(fd, slots, sizeof(slots), 0);
+
+	for (size_t i = 0; i < READER_SLOTS; i++)
+	{
+		if (slots[i].pid == 0)
+			continue;
+
+		if (kill(slots[i].pid, 0) == -1 && errno == ESRCH)
+		{
+			ReaderSlot slot = {};
+			pwrite(fd, &slot, sizeof(slot), i * sizeof(slot));
+		}
+		else if (slots[i].epoch < oldestEpoch)
+			oldestEpoch = slots[i].epoch;
+	}
+
+	flock(fd, LOCK_UN);
+	::close(fd);
+
+	return oldestEpoch;
+}
+
+/**************************************************************************
+* Function to size and fill a blocked Bloom filter. Every key sets all of
+* its bits inside one 512 bit block, so a lookup touches a single cache line.
+**************************************************************************/
+inline void Index::buildBloomFilter(vector<uint64_t> &hashes, double falsePositiveRate)
+{
+	size_t numKeys = hashes.size() > 0 ? hashes.size() : 1;
+	double bitsPerKey = -log(falsePositiveRate) / (log(2.0) * log(2.0));
+
+	bloom.numHashes = (size_t)(bitsPerKey * log(2.0) + 0.5);
+	if (bloom.numHashes < 1)
+		bloom.numHashes = 1;
+	if (bloom.numHashes > 16)
+		bloom.numHashes = 16;
+
+	bloom.numBlocks = (size_t)ceil(bitsPerKey * numKeys / 512);
+	if (bloom.numBlocks < 1)
+		bloom.numBlocks = 1;
+
+	bloom.numKeys = 0;
+	bloom.bits.assign(bloom.numBlocks * 8, 0);
+	bloom.loaded = true;
+
+	for (size_t i = 0; i < hashes.size(); i++)
+		bloomAdd(hashes[i]);
+}
+
+/**************************************************************************
+* Function to add a key hash to the Bloom filter. Returns the block changed
+**************************************************************************/
+inline size_t Index::bloomAdd(uint64_t hash)
+{
+	size_t blockNum = hash % bloom.numBlocks;
+	uint64_t *block = &bloom.bits[blockNum * 8];
+
+	uint32_t h1 = (uint32_t)(hash >> 32);
+	uint32_t h2 = (uint32_t)hash | 1;
+
+	for (size_t i = 0; i < bloom.numHashes; i++)
+	{
+		uint32_t bit = (h1 + i * h2) & 511;
+		block[bit >> 6] |= (uint64_t)1 << (bit & 63);
+	}
+
+	bloom.numKeys++;
+	return blockNum;
+}
+
+/**************************************************************************
+* Function to check the Bloom filter. False means the key is definitely absent
+**************************************************************************/
+inline bool Index::bloomMayContain(uint64_t hash)
+{
+	const uint64_t *block = &bloom.bits[(hash % bloom.numBlocks) * 8];
+
+	uint32_t h1 = (uint32_t)(hash >> 32);
+	uint32_t h2 = (uint32_t)hash | 1;
+
+	for (size_t i = 0; i < bloom.numHashes; i++)
+	{
+		uint32_t bit = (h1 + i * h2) & 511;
+		if ((block[bit >> 6] & ((uint64_t)1 << (bit & 63))) == 0)
+			return false;
+	}
+
+	return true;
+}
+
+/**************************************************************************
+* Function to read the Bloom filter sidecar. The file holds an 8 byte
+* magic, the block count, hash count and key count, then the bit blocks.
+* Returns false if the index has no filter.
+**************************************************************************/
+inline bool Index::loadBloomFilter(const char *fileName)
+{
+	if (bloom.loaded)
+		return true;
+
+	int bloomFd = ::open(fileName, O_RDONLY);
+	if (bloomFd == -1)
+		return false;
+
+	//The bits go into the vector the filter already has, which inserts read again each time
+	char header[32];
+	bool read = pread(bloomFd, header, 32, 0) == 32 && memcmp(header, "BPBLOOM1", 8) == 0;
+
+	if (read)
+	{
+		memcpy((char*)&bloom.numBlocks, header + 8, 8);
+		memcpy((char*)&bloom.numHashes, header + 16, 8);
+		memcpy((char*)&bloom.numKeys, header + 24, 8);
+		read = bloom.numBlocks != 0;
+	}
+
+	if (read)
+	{
+		bloom.bits.resize(bloom.numBlocks * 8);
+		read = pread(bloomFd, &bloom.bits[0], bloom.numBlocks * 64, 32) == (ssize_t)(bloom.numBlocks * 64);
+	}
+
+	::close(bloomFd);
+
+	bloom.loaded = read;
+	return read;
+}
+
+/**************************************************************************
+* Function to tell whether the Bloom filter sidecar differs from the copy
+* in memory. Writers only ever add keys, so its key count is compared.
+**************************************************************************/
+inline bool Index::bloomFilterChanged(const char *fileName)
+{
+	int bloomFd = ::open(fileName, O_RDONLY);
+	if (bloomFd == -1)
+		return bloom.loaded;
+
+	char header[32];
+	bool changed = !bloom.loaded || pread(bloomFd, header, 32, 0) != 32 || memcmp(header + 24, (char*)&bloom.numKeys, 8) != 0;
+
+	::close(bloomFd);
+	return changed;
+}
+
+/**************************************************************************
+* Function to write the whole Bloom filter sidecar
+**************************************************************************/
+inline void Index::saveBloomFilter(const char *fileName)
+{
+	ofstream bloomFile(fileName, ios::out | ios::binary | ios::trunc);
+
+	bloomFile.write("BPBLOOM1", 8);
+	bloomFile.write((char*)&bloom.numBlocks, 8);
+	bloomFile.write((char*)&bloom.numHashes, 8);
+	bloomFile.write((char*)&bloom.numKeys, 8);
+	bloomFile.write((char*)&bloom.bits[0], bloom.numBlocks * 64);
+}
+
+/**************************************************************************
+* Function to write back one changed block and the key count, so an
+* insert does not rewrite the whole filter
+**************************************************************************/
+inline void Index::saveBloomBlock(const char *fileName, size_t blockNum)
+{
+	int bloomFd = ::open(fileName, O_WRONLY);
+	if (bloomFd == -1)
+		return;
+
+	pwrite(bloomFd, (char*)&bloom.numKeys, 8, 24);
+	pwrite(bloomFd, (char*)&bloom.bits[blockNum * 8], 64, 32 + blockNum * 64);
+
+	::close(bloomFd);
+}
+
+/**************************************************************************
+* Function to write the metadata block. Bytes 288 onward hold a version tag
+* followed by the fields added after the original layout; indexes written
+* before then have no tag and get the defaults for those fields.
+**************************************************************************/
+inline void Index::writeMetadata(fstream &output)
+{
+	char metaBlock[1024] = {};
+
+	memcpy(&metaBlock[0], metadata.fileName, 256);
+	memcpy(&metaBlock[256], (char*)&metadata.keyLength, 8);
+	memcpy(&metaBlock[264], (char*)&metadata.root, 8);
+	memcpy(&metaBlock[272], (char*)&metadata.maxNode, 8);
+	memcpy(&metaBlock[280], (char*)&metadata.level, 8);
+	memcpy(&metaBlock[288], "BPMETA01", 8);
+	memcpy(&metaBlock[296], (char*)&metadata.recordFormat, 8);
+	memcpy(&metaBlock[304], (char*)&metadata.epoch, 8);
+	memcpy(&metaBlock[312], (char*)&metadata.leafFormat, 8);
+	memcpy(&metaBlock[320], (char*)&metadata.pageChecksums, 8);
+	memcpy(&metaBlock[328], (char*)&metadata.textLength, 8);
+	memcpy(&metaBlock[336], metadata.textFileName, 256);
+	memcpy(&metaBlock[592], metadata.lowKey, 40);
+	memcpy(&metaBlock[632], metadata.highKey, 40);
+	sealBlock(metaBlock);
+
+	output.seekp(0, ios::beg);
+	output.write(metaBlock, 1024);
+}
+
+/**************************************************************************
+* Function to read the metadata block
+**************************************************************************/
+inline void Index::readMetadata(fstream &input)
+{
+	char metaBlock[1024] = {};
+
+	input.seekg(0, ios::beg);
+	input.read(metaBlock, 1024);
+
+	memcpy(metadata.fileName, &metaBlock[0], 256);
+	memcpy((char*)&metadata.keyLength, &metaBlock[256], 8);
+	memcpy((char*)&metadata.root, &metaBlock[264], 8);
+	memcpy((char*)&metadata.maxNode, &metaBlock[272], 8);
+	memcpy((char*)&metadata.level, &metaBlock[280], 8);
+
+	metadata.recordFormat = RECORD_FORMAT_TEXT;
+	metadata.epoch = 0;
+	metadata.leafFormat = LEAF_FORMAT_PLAIN;
+	metadata.pageChecksums = 0;
+	metadata.textLength = 0;
+	memset(metadata.textFileName, 0, sizeof(metadata.textFileName));
+	memset(metadata.lowKey, 0, sizeof(metadata.lowKey));
+	memset(metadata.highKey, 0, sizeof(metadata.highKey));
+
+	if (memcmp(&metaBlock[288], "BPMETA01", 8) == 0)
+	{
+		memcpy((char*)&metadata.recordFormat, &metaBlock[296], 8);
+		memcpy((char*)&metadata.epoch, &metaBlock[304], 8);
+		memcpy((char*)&metadata.leafFormat, &metaBlock[312], 8);
+		memcpy((char*)&metadata.pageChecksums, &metaBlock[320], 8);
+		memcpy((char*)&metadata.textLength, &metaBlock[328], 8);
+		memcpy(metadata.textFileName, &metaBlock[336], 256);
+		memcpy(metadata.lowKey, &metaBlock[592], 40);
+		memcpy(metadata.highKey, &metaBlock[632], 40);
+	}
+}
+
+/**************************************************************************
+* Function to get the record file name, which is padded with '.' to 256 bytes
+**************************************************************************/
+inline string Index::recordFileNameFromMetadata()
+{
+	size_t fileNameSize = 256;
+
+	while (fileNameSize > 0 && (metadata.fileName[fileNameSize - 1] == '.' || metadata.fileName[fileNameSize - 1] == '\0'))
+		fileNameSize--;
+
+	return string(metadata.fileName, fileNameSize);
+}
+
+/**************************************************************************
+* Function to get the name of a file kept next to the index, such as its
+* free list or readers file. Inserts open several of these each time, so
+* the name is built in a buffer kept for the purpose rather than in a
+* new string; it is valid until the next call.
+**************************************************************************/
+inline const char *Index::sidecarFileName(const char *suffix)
+{
+	sidecarName.assign(fileName);
+	sidecarName.append(suffix);
+
+	return sidecarName.c_str();
+}
+
+/**************************************************************************
+* Function to place a new record in the last page of the binary record file,
+* or in a fresh page if it is full. The page is only changed in memory;
+* the caller writes it back to pageNum once the index insert succeeds.
+* Returns the (page, slot) offset of the record.
+**************************************************************************/
+inline size_t Index::reserveBinaryRecord(int recordFd, char page[], size_t &pageNum, const char *data, size_t length)
+{
+	struct stat recordStat;
+	size_t fileSize = fstat(recordFd, &recordStat) == 0 ? recordStat.st_size : 0;
+	size_t slot;
+
+	pageNum = fileSize / RECORD_PAGE_SIZE;
+
+	if (pageNum > 0)
+	{
+		pageNum--;
+
+		if (pread(recordFd, page, RECORD_PAGE_SIZE, pageNum * RECORD_PAGE_SIZE) == (ssize_t)RECORD_PAGE_SIZE && addRecordToPage(page, data, length, slot))
+			return (pageNum << RECORD_SLOT_BITS) | slot;
+
+		pageNum++;
+	}
+
+	initRecordPage(page);
+	addRecordToPage(page, data, length, slot);
+
+	return (pageNum << RECORD_SLOT_BITS) | slot;
+}
+
+/**************************************************************************
+* Function to map the binary record file into memory for reading
+**************************************************************************/
+inline bool Index::openRecordStore(string fileName)
+{
+	if (recordStore.fd != -1)
+		return true;
+
+	recordStore.fd = ::open(fileName.c_str(), O_RDONLY);
+	if (recordStore.fd == -1)
+		return false;
+
+	struct stat fileStat;
+	if (fstat(recordStore.fd, &fileStat) == 0 && fileStat.st_size > 0)
+	{
+		void *map = mmap(NULL, fileStat.st_size, PROT_READ, MAP_SHARED, recordStore.fd, 0);
+		if (map != MAP_FAILED)
+		{
+			recordStore.map = (char*)map;
+			recordStore.mapLength = fileStat.st_size;
+		}
+	}
+
+	return true;
+}
+
+/**************************************************************************
+* Function to locate a binary record by its (page, slot) offset. Pages
+* inside the mapping are used in place; any other page is fetched with
+* one aligned page read.
+**************************************************************************/
+inline bool Index::fetchBinaryRecord(size_t offset, const char *&data, size_t &length)
+{
+	size_t pageNum = offset >> RECORD_SLOT_BITS;
+	size_t slot = offset & (((size_t)1 << RECORD_SLOT_BITS) - 1);
+	const char *page;
+
+	if ((pageNum + 1) * RECORD_PAGE_SIZE <= recordStore.mapLength)
+		page = recordStore.map + pageNum * RECORD_PAGE_SIZE;
+	else if (pread(recordStore.fd, recordStore.page, RECORD_PAGE_SIZE, pageNum * RECORD_PAGE_SIZE) == (ssize_t)RECORD_PAGE_SIZE)
+		page = recordStore.page;
+	else
+		return false;
+
+	return recordInPage(page, slot, data, length);
+}
+
+/**************************************************************************
+* Function to compare two keys over the key length
+**************************************************************************/
+inline int Index::compareKeys(const char *a, const char *b)
+{
+	return strncmp(a, b, metadata.keyLength);
+}
+
+/**************************************************************************
+* Function to check a key is in the key range of the index, which only a
+* shard has
+**************************************************************************/
+inline bool Index::keyInShard(const char *key)
+{
+	if (metadata.lowKey[0] != '\0' && compareKeys(key, metadata.lowKey) < 0)
+		return false;
+	if (metadata.highKey[0] != '\0' && compareKeys(key, metadata.highKey) >= 0)
+		return false;
+
+	return true;
+}
+
+/**************************************************************************
+* Functions to get the key and offset of a leaf entry from a leaf block
+**************************************************************************/
+inline const char *Index::leafEntryKey(const char block[], size_t numRec)
+{
+	return &block[(metadata.keyLength + 8)*numRec];
+}
+
+inline size_t Index::leafEntryOffset(const char block[], size_t numRec)
+{
+	size_t offset;
+	memcpy((char*)&offset, &block[(metadata.keyLength + 8)*numRec + metadata.keyLength], 8);
+	return offset;
+}
+
+/**************************************************************************
+* Function to find the position of the first leaf entry not less than the
+* key. The position is that of the NULL key if every entry is less.
+**************************************************************************/
+inline size_t Index::leafLowerBound(const char block[], const char *key)
+{
+	size_t numRec = 0;
+	size_t maxEntries = leafCapacity();
+
+	while (numRec < maxEntries)
+	{
+		const char *entryKey = leafEntryKey(block, numRec);
+		if (isNullKey(entryKey) || compareKeys(key, entryKey) <= 0)
+			break;
+
+		numRec++;
+	}
+
+	return numRec;
+}
+
+/**************************************************************************
+* Function to pick which child of an internal node block to follow for a
+* key. Keys equal to a separator belong to the right child.
+**************************************************************************/
+inline size_t Index::childPosition(const char block[], const char *key)
+{
+	size_t pos = 0;
+
+	while (pos < metadata.maxNode)
+	{
+		const char *separator = &block[pos * (metadata.keyLength + 8) + 8];
+		if (isNullKey(separator) || compareKeys(key, separator) < 0)
+			break;
+
+		pos++;
+	}
+
+	return pos;
+}
+
+/**************************************************************************
+* Function to get a child pointer of an internal node block
+**************************************************************************/
+inline size_t Index::internalChild(const char block[], size_t pos)
+{
+	size_t child;
+	memcpy((char*)&child, &block[pos * (metadata.keyLength + 8)], 8);
+	return child;
+}
+
+/**************************************************************************
+* Function to count the keys in an internal node block
+**************************************************************************/
+inline size_t Index::internalKeyCount(const char block[])
+{
+	size_t count = 0;
+
+	while (count + 1 < metadata.maxNode && !isNullKey(&block[count * (metadata.keyLength + 8) + 8]))
+		count++;
+
+	return count;
+}
+
+/**************************************************************************
+* Function to get the child of an internal node block to follow for a key
+**************************************************************************/
+inline size_t Index::childForKey(const char block[], const char *key)
+{
+	return internalChild(block, childPosition(block, key));
+}
+
+/**************************************************************************
+* Function to walk from the root to the leaf node block a key belongs in
+**************************************************************************/
+inline size_t Index::descendToLeaf(fstream &indexFile, const char *key)
+{
+	char block[1024];
+	size_t offsetPtr = metadata.root;
+
+	for (size_t levelCount = 1; levelCount < metadata.level; levelCount++)
+	{
+		indexFile.seekg(offsetPtr, ios::beg);
+		indexFile.read(block, 1024);
+		if (!blockIntact(block))
+			return 0;
+
+		offsetPtr = childForKey(block, key);
+	}
+
+	return offsetPtr;
+}
+
+/**************************************************************************
+* Function to position a leaf cursor on the leaf a key belongs in. The
+* cursor keeps the internal nodes on the path so it can move on to the
+* following leaves.
+**************************************************************************/
+inline size_t Index::cursorSeek(LeafCursor &cursor, int indexFd, const char *key)
+{
+	size_t offsetPtr = metadata.root;
+	size_t depth = metadata.level > 0 ? metadata.level - 1 : 0;
+
+	cursor.positions.assign(depth, 0);
+	cursor.blocks.resize(depth * 1024);
+
+	for (size_t i = 0; i < depth; i++)
+	{
+		char *block = &cursor.blocks[i * 1024];
+		pread(indexFd, block, 1024, offsetPtr);
+		if (!blockIntact(block))
+			return 0;
+
+		cursor.positions[i] = childPosition(block, key);
+		offsetPtr = internalChild(block, cursor.positions[i]);
+	}
+
+	return offsetPtr;
+}
+
+/**************************************************************************
+* Function to move a leaf cursor to the next leaf. Returns 0 after the last
+**************************************************************************/
+inline size_t Index::cursorNextLeaf(LeafCursor &cursor, int indexFd)
+{
+	size_t depth = cursor.positions.size();
+
+	//Climb to the lowest node with a child further right
+	while (depth > 0 && cursor.positions[depth - 1] >= internalKeyCount(&cursor.blocks[(depth - 1) * 1024]))
+		depth--;
+
+	if (depth == 0)
+		return 0;
+
+	cursor.positions[depth - 1]++;
+	size_t offsetPtr = internalChild(&cursor.blocks[(depth - 1) * 1024], cursor.positions[depth - 1]);
+
+	//Then down the leftmost path below it
+	for (size_t i = depth; i < cursor.positions.size(); i++)
+	{
+		char *block = &cursor.blocks[i * 1024];
+		pread(indexFd, block, 1024, offsetPtr);
+		if (!blockIntact(block))
+			return 0;
+
+		cursor.positions[i] = 0;
+		offsetPtr = internalChild(block, 0);
+	}
+
+	return offsetPtr;
+}
+
+/**************************************************************************
+* Function to start the asynchronous I/O engine. io_uring is used when the
+* kernel allows it, otherwise a pool of threads issuing pread.
+**************************************************************************/
+inline void Index::initAsyncIO(size_t queueDepth, string engine)
+{
+	if (asyncIO.initialized)
+		return;
+
+	asyncIO.initialized = true;
+	asyncIO.queueDepth = queueDepth > 0 ? queueDepth : 1;
+
+#ifdef BPINDEX_HAVE_IO_URING
+	if (!icompare(engine, "threads") && initRing(asyncIO.queueDepth))
+	{
+		asyncIO.useRing = true;
+		return;
+	}
+#endif
+
+	for (size_t i = 0; i < asyncIO.queueDepth; i++)
+		asyncIO.workers.push_back(thread(&Index::asyncWorker, this));
+}
+
+/**************************************************************************
+* Function to stop the thread pool and release the ring
+**************************************************************************/
+inline void Index::shutdownAsyncIO()
+{
+	if (!asyncIO.initialized)
+		return;
+
+	{
+		lock_guard<mutex> guard(asyncIO.lock);
+		asyncIO.stopping = true;
+	}
+	asyncIO.workReady.notify_all();
+
+	for (size_t i = 0; i < asyncIO.workers.size(); i++)
+		asyncIO.workers[i].join();
+
+	asyncIO.workers.clear();
+
+	//The ring mappings go before the fd they were made from
+	if (asyncIO.sqesMap != NULL)
+		munmap(asyncIO.sqesMap, asyncIO.sqesMapLength);
+	if (asyncIO.cqMap != NULL && asyncIO.cqMap != asyncIO.sqMap)
+		munmap(asyncIO.cqMap, asyncIO.cqMapLength);
+	if (asyncIO.sqMap != NULL)
+		munmap(asyncIO.sqMap, asyncIO.sqMapLength);
+
+	asyncIO.sqMap = NULL;
+	asyncIO.cqMap = NULL;
+	asyncIO.sqesMap = NULL;
+
+	if (asyncIO.ringFd != -1)
+		::close(asyncIO.ringFd);
+
+	asyncIO.ringFd = -1;
+	asyncIO.initialized = false;
+	asyncIO.useRing = false;
+	asyncIO.stopping = false;
+}
+
+/**************************************************************************
+* Function run by each thread of the pread pool
+**************************************************************************/
+inline void Index::asyncWorker()
+{
+	unique_lock<mutex> guard(asyncIO.lock);
+
+	while (true)
+	{
+		while (!asyncIO.stopping && (asyncIO.batch == NULL || asyncIO.nextRequest >= asyncIO.batch->size()))
+			asyncIO.workReady.wait(guard);
+
+		if (asyncIO.stopping)
+			return;
+
+		ReadRequest &request = (*asyncIO.batch)[asyncIO.nextRequest];
+		asyncIO.nextRequest++;
+
+		guard.unlock();
+		completeRead(request, 0);
+		guard.lock();
+
+		asyncIO.pending--;
+		if (asyncIO.pending == 0)
+			asyncIO.workDone.notify_all();
+	}
+}
+
+/**************************************************************************
+* Function to run a batch of reads, keeping up to the queue depth in
+* flight at once. Returns when every read has finished.
+**************************************************************************/
+inline void Index::submitReads(vector<ReadRequest> &requests)
+{
+	if (requests.empty())
+		return;
+
+	if (!asyncIO.initialized)
+		initAsyncIO(options.ioDepth, options.ioEngine);
+
+#ifdef BPINDEX_HAVE_IO_URING
+	if (asyncIO.useRing)
+	{
+		submitRingReads(requests);
+		return;
+	}
+#endif
+
+	unique_lock<mutex> guard(asyncIO.lock);
+	asyncIO.batch = &requests;
+	asyncIO.nextRequest = 0;
+	asyncIO.pending = requests.size();
+	asyncIO.workReady.notify_all();
+
+	while (asyncIO.pending > 0)
+		asyncIO.workDone.wait(guard);
+
+	asyncIO.batch = NULL;
+}
+
+#ifdef BPINDEX_HAVE_IO_URING
+/**************************************************************************
+* Function to set up an io_uring instance and map its rings
+**************************************************************************/
+inline bool Index::initRing(size_t queueDepth)
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+
+	int ringFd = syscall(__NR_io_uring_setup, queueDepth, &params);
+	if (ringFd < 0)
+		return false;
+
+	size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	bool singleMap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+
+	if (singleMap)
+		sqSize = cqSize = max(sqSize, cqSize);
+
+	void *sq = mmap(NULL, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+	void *cq = sq;
+	if (!singleMap && sq != MAP_FAILED)
+		cq = mmap(NULL, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+	size_t sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	void *sqes = mmap(NULL, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+
+	if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED)
+	{
+		if (sqes != MAP_FAILED)
+			munmap(sqes, sqesSize);
+		if (cq != MAP_FAILED && cq != sq)
+			munmap(cq, cqSize);
+		if (sq != MAP_FAILED)
+			munmap(sq, sqSize);
+
+		::close(ringFd);
+		return false;
+	}
+
+	asyncIO.ringFd = ringFd;
+	asyncIO.sqMap = sq;
+	asyncIO.sqMapLength = sqSize;
+	asyncIO.cqMap = cq;
+	asyncIO.cqMapLength = cqSize;
+	asyncIO.sqesMap = sqes;
+	asyncIO.sqesMapLength = sqesSize;
+	asyncIO.sqEntries = params.sq_entries;
+	asyncIO.sqTail = (unsigned*)((char*)sq + params.sq_off.tail);
+	asyncIO.sqMask = (unsigned*)((char*)sq + params.sq_off.ring_mask);
+	asyncIO.sqArray = (unsigned*)((char*)sq + params.sq_off.array);
+	asyncIO.sqes = (struct io_uring_sqe*)sqes;
+	asyncIO.cqHead = (unsigned*)((char*)cq + params.cq_off.head);
+	asyncIO.cqTail = (unsigned*)((char*)cq + params.cq_off.tail);
+	asyncIO.cqMask = (unsigned*)((char*)cq + params.cq_off.ring_mask);
+	asyncIO.cqes = (struct io_uring_cqe*)((char*)cq + params.cq_off.cqes);
+
+	return true;
+}
+
+/**************************************************************************
+* Function to run a batch of reads through io_uring. Reads that fail or
+* come back short are finished with pread. The kernel may take fewer of
+* the queued reads than it is offered; the rest are offered again.
+**************************************************************************/
+inline void Index::submitRingReads(vector<ReadRequest> &requests)
+{
+	size_t depth = min(asyncIO.queueDepth, (size_t)asyncIO.sqEntries);
+	size_t next = 0;			//Next request to queue
+	size_t completed = 0;
+	size_t queued = 0;			//In the submission ring, not yet taken by the kernel
+	size_t inKernel = 0;		//Taken by the kernel, not yet completed
+
+	while (completed < requests.size())
+	{
+		unsigned tail = *asyncIO.sqTail;
+
+		while (next < requests.size() && queued + inKernel < depth)
+		{
+			ReadRequest &request = requests[next];
+			unsigned index = tail & *asyncIO.sqMask;
+			struct io_uring_sqe *sqe = &asyncIO.sqes[index];
+
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode = IORING_OP_READ;
+			sqe->fd = request.fd;
+			sqe->addr = (uint64_t)(uintptr_t)request.buffer;
+			sqe->len = request.length;
+			sqe->off = request.offset;
+			sqe->user_data = next;
+
+			asyncIO.sqArray[index] = index;
+			tail++;
+			next++;
+			queued++;
+		}
+
+		__atomic_store_n(asyncIO.sqTail, tail, __ATOMIC_RELEASE);
+
+		//Only wait on reads the kernel already has; the queued ones may not all be taken
+		unsigned minComplete = inKernel > 0 ? 1 : 0;
+		unsigned flags = inKernel > 0 ? IORING_ENTER_GETEVENTS : 0;
+
+		int result = syscall(__NR_io_uring_enter, asyncIO.ringFd, (unsigned)queued, minComplete, flags, NULL, 0);
+		if (result < 0 && errno == EINTR)
+			continue;
+
+		if (result < 0)
+		{
+			//The ring is unusable; finish everything that has not completed with pread
+			for (size_t i = 0; i < requests.size(); i++)
+				if (requests[i].result < 0)
+					completeRead(requests[i], 0);
+			return;
+		}
+
+		queued = queued - result;
+		inKernel = inKernel + result;
+
+		unsigned head = *asyncIO.cqHead;
+		while (head != __atomic_load_n(asyncIO.cqTail, __ATOMIC_ACQUIRE))
+		{
+			struct io_uring_cqe *cqe = &asyncIO.cqes[head & *asyncIO.cqMask];
+			ReadRequest &request = requests[cqe->user_data];
+
+			if (cqe->res < 0)
+				completeRead(request, 0);
+			else if ((size_t)cqe->res < request.length)
+				completeRead(request, cqe->res);
+			else
+				request.result = cqe->res;
+
+			head++;
+			completed++;
+			inKernel--;
+		}
+
+		__atomic_store_n(asyncIO.cqHead, head, __ATOMIC_RELEASE);
+	}
+}
+
+#endif
+
+/**************************************************************************
+* Function to get the size of one record read. Binary records take one
+* page; text records are read in a chunk that holds a typical line.
+**************************************************************************/
+inline size_t Index::recordReadLength()
+{
+	if (metadata.recordFormat == RECORD_FORMAT_TEXT)
+		return TEXT_RECORD_READ;
+
+	return RECORD_PAGE_SIZE;
+}
+
+/**************************************************************************
+* Function to fill in the read request for the record at an offset
+**************************************************************************/
+inline void Index::prepareRecordRead(ReadRequest &request, int recordFd, size_t offset, char *buffer)
+{
+	request.fd = recordFd;
+	request.buffer = buffer;
+	request.result = -1;
+
+	if (metadata.recordFormat == RECORD_FORMAT_TEXT)
+	{
+		request.offset = offset;
+		request.length = TEXT_RECORD_READ;
+	}
+	else
+	{
+		request.offset = (offset >> RECORD_SLOT_BITS) * RECORD_PAGE_SIZE;
+		request.length = RECORD_PAGE_SIZE;
+	}
+}
+
+/**************************************************************************
+* Function to read a set of index blocks with the asynchronous I/O engine.
+* The offsets are sorted, so each distinct one is read once and the reads
+* go through the file in order; blockIndex pairs each offset with its
+* buffer, in offset order. Blocks that fail their checksum are left out
+* of blockIndex. The vectors are the caller's, kept from level to level.
+**************************************************************************/
+inline void Index::readIndexBlocks(int indexFd, vector<size_t> &offsets, vector<pair<size_t, size_t> > &blockIndex, vector<char> &blocks)
+{
+	blockIndex.clear();
+
+	sort(offsets.begin(), offsets.end());
+	offsets.erase(unique(offsets.begin(), offsets.end()), offsets.end());
+
+	vector<ReadRequest> &requests = levelReads;
+	requests.clear();
+
+	for (size_t i = 0; i < offsets.size(); i++)
+	{
+		blockIndex.push_back(make_pair(offsets[i], requests.size()));
+
+		ReadRequest request;
+		request.fd = indexFd;
+		request.offset = offsets[i];
+		request.length = 1024;
+		request.buffer = NULL;
+		request.result = -1;
+		requests.push_back(request);
+	}
+
+	blocks.resize(requests.size() * 1024);
+	for (size_t i = 0; i < requests.size(); i++)
+		requests[i].buffer = &blocks[i * 1024];
+
+	submitReads(requests);
+
+	size_t intact = 0;
+	for (size_t i = 0; i < requests.size(); i++)
+		if (blockIntact(requests[i].buffer))
+			blockIndex[intact++] = blockIndex[i];
+
+	blockIndex.resize(intact);
+}
+
+/**************************************************************************
+* Function to get the buffer readIndexBlocks() read a block into, or NULL
+* if it was not read or failed its checksum
+**************************************************************************/
+inline const char *Index::indexedBlock(const vector<pair<size_t, size_t> > &blockIndex, const vector<char> &blocks, size_t offset)
+{
+	vector<pair<size_t, size_t> >::const_iterator found = lower_bound(blockIndex.begin(), blockIndex.end(), make_pair(offset, (size_t)0));
+
+	if (found == blockIndex.end() || found->first != offset)
+		return NULL;
+
+	return &blocks[found->second * 1024];
+}
+
+/**************************************************************************
+* Function to finish a lookup in its leaf block. A key past the last entry
+* of the leaf it descended to is not in the index.
+**************************************************************************/
+inline void Index::stepLeafLookup(const char block[], BatchLookup &lookup)
+{
+	char expanded[LEAF_BUFFER_SIZE];
+	const char *leaf = openLeaf(block, expanded);
+
+	size_t numRec = leafLowerBound(leaf, lookup.key);
+	const char *entryKey = leafEntryKey(leaf, numRec);
+
+	if (!isNullKey(entryKey) && compareKeys(lookup.key, entryKey) == 0)
+	{
+		lookup.found = true;
+		lookup.offset = leafEntryOffset(leaf, numRec);
+	}
+
+	lookup.active = false;
+}
+
+/**************************************************************************
+* Function to resolve a batch of lookups by reading the index. All lookups
+* descend the tree together one level at a time, so every node read of a
+* level is in flight at once.
+**************************************************************************/
+inline void Index::resolveLookupsByLevel(int indexFd, vector<BatchLookup> &lookups)
+{
+	vector<size_t> &offsets = levelOffsets;
+	vector<pair<size_t, size_t> > &blockIndex = levelBlockIndex;
+	vector<char> &blocks = levelBlocks;
+
+	//Internal levels
+	for (size_t levelCount = 1; levelCount < metadata.level; levelCount++)
+	{
+		offsets.clear();
+		for (size_t i = 0; i < lookups.size(); i++)
+			if (lookups[i].active)
+				offsets.push_back(lookups[i].node);
+
+		readIndexBlocks(indexFd, offsets, blockIndex, blocks);
+
+		for (size_t i = 0; i < lookups.size(); i++)
+		{
+			if (!lookups[i].active)
+				continue;
+
+			const char *block = indexedBlock(blockIndex, blocks, lookups[i].node);
+			if (block == NULL)
+			{
+				lookups[i].active = false;
+				continue;
+			}
+
+			lookups[i].node = childForKey(block, lookups[i].key);
+			lookups[i].levelCount++;
+		}
+	}
+
+	//Leaf level
+	offsets.clear();
+	for (size_t i = 0; i < lookups.size(); i++)
+		if (lookups[i].active)
+			offsets.push_back(lookups[i].node);
+
+	readIndexBlocks(indexFd, offsets, blockIndex, blocks);
+
+	for (size_t i = 0; i < lookups.size(); i++)
+	{
+		if (!lookups[i].active)
+			continue;
+
+		const char *block = indexedBlock(blockIndex, blocks, lookups[i].node);
+		if (block == NULL)
+			lookups[i].active = false;
+		else
+			stepLeafLookup(block, lookups[i]);
+	}
+}
+
+/**************************************************************************
+* Function to map the whole index file into memory for in-memory lookups
+**************************************************************************/
+inline const char *Index::mapIndexFile(string fileName, size_t &length)
+{
+	int fd = ::open(fileName.c_str(), O_RDONLY);
+	if (fd == -1)
+		return NULL;
+
+	struct stat fileStat;
+	void *map = MAP_FAILED;
+
+	if (fstat(fd, &fileStat) == 0 && fileStat.st_size > 0)
+		map = mmap(NULL, fileStat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+	::close(fd);
+
+	if (map == MAP_FAILED)
+		return NULL;
+
+	length = fileStat.st_size;
+	return (const char*)map;
+}
+
+/**************************************************************************
+* Function to take a lookup one node further down a mapped index. Returns
+* false once the lookup has finished.
+**************************************************************************/
+inline bool Index::stepMappedLookup(const char *base, size_t length, BatchLookup &lookup)
+{
+	if (lookup.node + 1024 > length || !blockIntact(base + lookup.node))
+	{
+		lookup.active = false;
+		return false;
+	}
+
+	const char *block = base + lookup.node;
+
+	if (lookup.levelCount < metadata.level)
+	{
+		lookup.node = childForKey(block, lookup.key);
+		lookup.levelCount++;
+	}
+	else
+		stepLeafLookup(block, lookup);
+
+	return lookup.active;
+}
+
+/**************************************************************************
+* Function to resolve lookups one after another against a mapped index
+**************************************************************************/
+inline void Index::resolveLookupsSequential(const char *base, size_t length, vector<BatchLookup> &lookups)
+{
+	for (size_t i = 0; i < lookups.size(); i++)
+		while (lookups[i].active && stepMappedLookup(base, length, lookups[i]))
+			;
+}
+
+/**************************************************************************
+* Function to resolve lookups against a mapped index with a group of them
+* interleaved. Each lookup is a small state machine (its next node and
+* level): it prefetches its next node and yields to the next lookup in
+* the group, so the cache misses of the whole group overlap instead of
+* being paid one after another.
+**************************************************************************/
+inline void Index::resolveLookupsInterleaved(const char *base, size_t length, vector<BatchLookup> &lookups, size_t groupSize)
+{
+	vector<size_t> &group = lookupGroup;
+	size_t next = 0;
+
+	group.clear();
+	if (groupSize < 1)
+		groupSize = 1;
+
+	while (group.size() < groupSize && next < lookups.size())
+	{
+		if (lookups[next].active)
+		{
+			prefetchNode(base, length, lookups[next].node);
+			group.push_back(next);
+		}
+		next++;
+	}
+
+	size_t slot = 0;
+	while (!group.empty())
+	{
+		BatchLookup &lookup = lookups[group[slot]];
+
+		if (stepMappedLookup(base, length, lookup))
+		{
+			prefetchNode(base, length, lookup.node);
+			slot++;
+		}
+		else
+		{
+			//Finished; hand the slot to the next lookup still to run
+			while (next < lookups.size() && !lookups[next].active)
+				next++;
+
+			if (next < lookups.size())
+			{
+				group[slot] = next;
+				prefetchNode(base, length, lookups[next].node);
+				next++;
+				slot++;
+			}
+			else
+				group.erase(group.begin() + slot);
+		}
+
+		if (slot >= group.size())
+			slot = 0;
+	}
+}
+
+/**************************************************************************
+* Function to set up a lookup for a key
+**************************************************************************/
+inline void Index::initLookup(BatchLookup &lookup, const char *key)
+{
+	memset(lookup.key, 0, sizeof(lookup.key));
+	strncpy(lookup.key, key, metadata.keyLength);
+	lookup.node = metadata.root;
+	lookup.levelCount = 1;
+	lookup.active = metadata.root != 0;
+	lookup.found = false;
+	lookup.offset = 0;
+}
+
+/**************************************************************************
+* Functions to lend the buffers of the last iterator to go to the next
+* one, so that walking a range does not allocate once they are big enough
+**************************************************************************/
+inline RangeIterator::RangeIterator(RangeIterator &&other)
+{
+	index = other.index;
+	sharded = other.sharded;
+	owner = other.owner;
+	shard = other.shard;
+	memcpy(leaf, other.leaf, sizeof(leaf));
+	memcpy(nextLeaf, other.nextLeaf, sizeof(nextLeaf));
+	nextState = other.nextState;
+	numRec = other.numRec;
+	remaining = other.remaining;
+	fetchFirst = other.fetchFirst;
+	fetchEnd = other.fetchEnd;
+	pending = other.pending;
+	pendingEnd = other.pendingEnd;
+	fromBuffer = other.fromBuffer;
+
+	swap(cursor.positions, other.cursor.positions);
+	swap(cursor.blocks, other.cursor.blocks);
+	swap(requests, other.requests);
+	swap(buffers, other.buffers);
+	swap(overflow, other.overflow);
+
+	//The buffers are this iterator's to hand back now, and the one moved from is at its end
+	other.owner = NULL;
+	other.index = NULL;
+}
+
+inline RangeIterator::~RangeIterator()
+{
+	if (owner != NULL)
+		swapBuffers();
+}
+
+inline void RangeIterator::swapBuffers()
+{
+	swap(cursor.positions, owner->rangeCursor.positions);
+	swap(cursor.blocks, owner->rangeCursor.blocks);
+	swap(requests, owner->rangeRequests);
+	swap(buffers, owner->rangeBuffers);
+	swap(overflow, owner->rangeOverflow);
+}
+
+/**************************************************************************
+* Function to check the iterator is on an entry
+**************************************************************************/
+inline bool RangeIterator::valid() const
+{
+	return index != NULL && remaining > 0;
+}
+
+/**************************************************************************
+* Functions to move the iterator on to the next entry
+**************************************************************************/
+inline void RangeIterator::next()
+{
+	if (fromBuffer)
+		pending++;
+	else
+		numRec++;
+
+	remaining--;
+	settle();
+}
+
+inline RangeIterator &RangeIterator::operator++()
+{
+	next();
+	return *this;
+}
+
+/**************************************************************************
+* Functions to get the key and record offset of the current entry
+**************************************************************************/
+inline const char *RangeIterator::key() const
+{
+	if (fromBuffer)
+		return pending->first.data();
+
+	return index->leafEntryKey(leaf, numRec);
+}
+
+inline string RangeIterator::keyString() const
+{
+	return string(key(), index->metadata.keyLength);
+}
+
+inline size_t RangeIterator::offset() const
+{
+	if (fromBuffer)
+		return nullOffset;
+
+	return index->leafEntryOffset(leaf, numRec);
+}
+
+/**************************************************************************
+* Function to get the record of the current entry. The first call on a
+* leaf fetches the records of its remaining entries as one batch through
+* the asynchronous I/O engine, together with the next leaf.
+**************************************************************************/
+inline bool RangeIterator::record(RecordView &view)
+{
+	if (fromBuffer)
+	{
+		view.data = pending->second.data();
+		view.length = pending->second.length();
+		return true;
+	}
+
+	if (numRec < fetchFirst || numRec >= fetchEnd)
+		fetchRecords();
+
+	//The buffers move with the iterator when it is copied
+	size_t i = numRec - fetchFirst;
+	ReadRequest request = requests[i];
+	request.buffer = &buffers[i * index->recordReadLength()];
+
+	return index->recordFromRead(request, offset(), key(), view, overflow);
+}
+
+/**************************************************************************
+* Function to position the iterator on the first entry of its index not
+* less than key. The leaves are walked through the tree, since copy on
+* write inserts leave the links between leaves pointing at older copies.
+**************************************************************************/
+inline void RangeIterator::start(const char *key)
+{
+	numRec = 0;
+	nextState = 0;
+	fetchFirst = 0;
+	fetchEnd = 0;
+
+	//Records not yet flushed into the tree are merged in from the write buffer
+	char bufferKey[41] = {};
+	strncpy(bufferKey, key, index->metadata.keyLength);
+
+	index->lookupKey.assign(bufferKey, index->metadata.keyLength);
+	pending = index->writeBuffer.lower_bound(index->lookupKey);
+	pendingEnd = index->writeBuffer.end();
+
+	size_t offsetPtr = index->metadata.root != 0 ? index->cursorSeek(cursor, index->indexFd, key) : 0;
+
+	if (offsetPtr == 0 || pread(index->indexFd, nextLeaf, 1024, offsetPtr) != 1024 || !index->blockIntact(nextLeaf))
+	{
+		//An empty tree, or one whose path to the leaf is unreadable, reads as a single leaf with no entries
+		memcpy(leaf, nullKey, index->metadata.keyLength);
+		nextState = 2;
+	}
+	else
+	{
+		index->expandLeaf(nextLeaf, leaf);
+		numRec = index->leafLowerBound(leaf, key);
+	}
+
+	settle();
+}
+
+/**************************************************************************
+* Function to skip from the end of a leaf to the next leaf with entries.
+* Returns false once there are no more.
+**************************************************************************/
+inline bool RangeIterator::settleLeaf()
+{
+	while (isNullKey(index->leafEntryKey(leaf, numRec)))
+	{
+		if (nextState == 0)
+		{
+			size_t nextPtr = index->cursorNextLeaf(cursor, index->indexFd);
+			if (nextPtr == 0 || pread(index->indexFd, nextLeaf, 1024, nextPtr) != 1024 || !index->blockIntact(nextLeaf))
+				nextState = 2;
+			else
+				nextState = 1;
+		}
+
+		if (nextState == 2)
+			return false;
+
+		index->expandLeaf(nextLeaf, leaf);
+		numRec = 0;
+		nextState = 0;
+		fetchFirst = 0;
+		fetchEnd = 0;
+	}
+
+	return true;
+}
+
+/**************************************************************************
+* Function to settle on the next entry, from the tree or the write buffer,
+* whichever has the lower key, ending the range after the last one
+**************************************************************************/
+inline void RangeIterator::settle()
+{
+	while (remaining > 0)
+	{
+		bool inTree = settleLeaf();
+		bool inBuffer = pending != pendingEnd;
+
+		if (!inTree && !inBuffer)
+		{
+			//The last leaf of a shard is followed by the first leaf of the next shard
+			if (sharded != NULL && shard + 1 < sharded->shards.size())
+			{
+				shard++;
+				index = sharded->shards[shard];
+				start("");
+				return;
+			}
+
+			remaining = 0;
+			return;
+		}
+
+		int order = 1;
+		if (inTree && inBuffer)
+			order = index->compareKeys(pending->first.c_str(), index->leafEntryKey(leaf, numRec));
+
+		fromBuffer = inBuffer && (!inTree || order <= 0);
+
+		//A key being flushed can be in both; the buffered copy is the one kept
+		if (inTree && order == 0)
+		{
+			numRec++;
+			continue;
+		}
+
+		return;
+	}
+}
+
+/**************************************************************************
+* Function to read the records of the entries still wanted from the
+* current leaf, and the next leaf if the range runs on into it
+**************************************************************************/
+inline void RangeIterator::fetchRecords()
+{
+	size_t recordReadSize = index->recordReadLength();
+
+	fetchFirst = numRec;
+	fetchEnd = numRec;
+	while (!isNullKey(index->leafEntryKey(leaf, fetchEnd)) && fetchEnd - fetchFirst < remaining)
+		fetchEnd++;
+
+	size_t numReads = fetchEnd - fetchFirst;
+
+	//With room for the next leaf
+	requests.reserve(numReads + 1);
+	requests.resize(numReads);
+	buffers.resize(numReads * recordReadSize);
+
+	for (size_t i = 0; i < numReads; i++)
+		index->prepareRecordRead(requests[i], index->recordStore.fd, index->leafEntryOffset(leaf, fetchFirst + i), &buffers[i * recordReadSize]);
+
+	//Fetch the next leaf while the records are in flight
+	size_t nextPtr = 0;
+	if (nextState == 0 && isNullKey(index->leafEntryKey(leaf, fetchEnd)) && numReads < remaining)
+	{
+		nextPtr = index->cursorNextLeaf(cursor, index->indexFd);
+		nextState = nextPtr != 0 ? 1 : 2;
+	}
+
+	if (nextPtr != 0)
+	{
+		ReadRequest request;
+		request.fd = index->indexFd;
+		request.offset = nextPtr;
+		request.length = 1024;
+		request.buffer = nextLeaf;
+		request.result = -1;
+		requests.push_back(request);
+	}
+
+	index->submitReads(requests);
+
+	if (nextPtr != 0)
+	{
+		if (requests.back().result != 1024 || !index->blockIntact(nextLeaf))
+			nextState = 2;
+		requests.pop_back();
+	}
+}
+
+}
+
+#endif
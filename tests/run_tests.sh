@@ -0,0 +1,49 @@
+#!/bin/sh
+# Builds BPIndex and runs every test in this directory, each in a scratch
+# directory of its own. A test_*.sh test gets the program in $BPINDEX and
+# the sample data in $DATA; a test_*.cpp test is compiled against
+# BPIndex.h and run with the same two arguments. A test fails by exiting
+# non-zero. Run from anywhere: sh tests/run_tests.sh
+
+TESTS=$(cd "$(dirname "$0")" && pwd)
+ROOT=$(dirname "$TESTS")
+BUILD=$(mktemp -d)
+trap 'rm -rf "$BUILD"' EXIT
+
+CXX=${CXX:-g++}
+if ! $CXX -O2 -std=c++11 -pthread -o "$BUILD/BPIndex" "$ROOT/BPIndex.cpp"; then
+	echo "FAIL: BPIndex does not compile"
+	exit 1
+fi
+
+BPINDEX="$BUILD/BPIndex"
+DATA="$ROOT/CS6360Asg5TestDataA.txt"
+export BPINDEX DATA
+
+failed=0
+for test in "$TESTS"/test_*.sh "$TESTS"/test_*.cpp; do
+	[ -f "$test" ] || continue
+	name=$(basename "$test")
+	WORK="$BUILD/${name%.*}.work"
+	mkdir "$WORK"
+
+	case "$name" in
+	*.sh)
+		(cd "$WORK" && sh "$test") > "$WORK.log" 2>&1
+		;;
+	*.cpp)
+		$CXX -O2 -std=c++11 -pthread -I"$ROOT" -o "$WORK.bin" "$test" > "$WORK.log" 2>&1 &&
+			(cd "$WORK" && "$WORK.bin" "$BPINDEX" "$DATA") >> "$WORK.log" 2>&1
+		;;
+	esac
+
+	if [ $? -eq 0 ]; then
+		echo "PASS: $name"
+	else
+		echo "FAIL: $name"
+		sed 's/^/	/' "$WORK.log"
+		failed=1
+	fi
+done
+
+exit $failed
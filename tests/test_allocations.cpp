@@ -0,0 +1,272 @@
+/******************************************************************************
+* Checks that find(), findBatch(), range iterators and insert() do not
+* allocate once an Index is warmed up, with and without a record cache. operator new is replaced with one
+* that counts while a check runs; a check that counts any fails the test.
+*
+* Run by run_tests.sh as: test_allocations BPIndex sampleData.txt
+* The keys are 20 bytes, longer than a string holds without allocating.
+******************************************************************************/
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+static std::atomic<size_t> allocations(0);
+static std::atomic<bool> counting(false);
+
+void *operator new(size_t size)
+{
+	if (counting)
+		allocations++;
+
+	void *p = malloc(size > 0 ? size : 1);
+	if (p == NULL)
+		throw std::bad_alloc();
+
+	return p;
+}
+
+void *operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void operator delete[](void *p, size_t) noexcept { free(p); }
+
+#include "BPIndex.h"
+
+using namespace bpindex;
+
+static const size_t KEY_LENGTH = 20;
+static bool failed = false;
+
+/**************************************************************************
+* Functions to count the allocations of one check and report them
+**************************************************************************/
+static void startCounting()
+{
+	allocations = 0;
+	counting = true;
+}
+
+static void stopCounting(const string &format, const char *check, size_t calls)
+{
+	counting = false;
+
+	printf("%-7s %-20s %zu allocations in %zu calls\n", format.c_str(), check, (size_t)allocations, calls);
+	if (allocations > 0)
+		failed = true;
+}
+
+/**************************************************************************
+* Function to find every key one at a time
+**************************************************************************/
+static size_t findAll(Index &index, const vector<string> &keys, FindResult &result)
+{
+	size_t found = 0;
+
+	for (size_t i = 0; i < keys.size(); i++)
+		if (index.find(keys[i], result))
+			found++;
+
+	return found;
+}
+
+/**************************************************************************
+* Function to walk ranges from several keys, reading every record
+**************************************************************************/
+static size_t walkRanges(Index &index, const vector<string> &keys)
+{
+	size_t records = 0;
+
+	for (size_t i = 0; i < keys.size(); i += keys.size() / 8)
+	{
+		for (RangeIterator it = index.range(keys[i], 200); it.valid(); it.next())
+		{
+			RecordView view;
+			if (it.record(view))
+				records++;
+		}
+	}
+
+	//And the whole index
+	for (RangeIterator it = index.range("", keys.size() * 2); it.valid(); it.next())
+	{
+		RecordView view;
+		if (it.record(view))
+			records++;
+	}
+
+	return records;
+}
+
+/**************************************************************************
+* Function to check one record format
+**************************************************************************/
+static bool checkFormat(const string &dataFileName, const string &format, size_t recordFormat)
+{
+	string textFileName = "data_" + format + ".txt";
+	string indexFileName = "data_" + format + ".idx";
+
+	ifstream data(dataFileName.c_str(), ios::binary);
+	ofstream text(textFileName.c_str(), ios::binary);
+	text << data.rdbuf();
+	text.close();
+
+	IndexOptions options;
+	options.recordFormat = recordFormat;
+
+	Index created;
+	if (!created.create(textFileName, indexFileName, KEY_LENGTH, options))
+	{
+		printf("%s: %s\n", format.c_str(), created.lastError().c_str());
+		return false;
+	}
+	created.close();
+
+	//Every key of the data, and some that are not there
+	vector<string> keys;
+	ifstream lines(textFileName.c_str(), ios::binary);
+	string line;
+
+	while (getline(lines, line))
+		if (line.length() >= KEY_LENGTH)
+			keys.push_back(line.substr(0, KEY_LENGTH));
+
+	for (size_t i = 0; i < 50; i++)
+	{
+		char missing[32];
+		snprintf(missing, sizeof(missing), "00000000000000%06zu", i * 7);
+		keys.push_back(missing);
+	}
+
+	Index index;
+	IndexOptions mappedOptions;
+	mappedOptions.mmap = true;
+	Index mapped;
+
+	//A cache that holds every record, and one that keeps evicting them
+	IndexOptions cachedOptions;
+	cachedOptions.cacheBytes = 1048576;
+	Index cached;
+	IndexOptions evictingOptions;
+	evictingOptions.cacheBytes = 32768;
+	Index evicting;
+
+	if (!index.open(indexFileName) || !mapped.open(indexFileName, mappedOptions) || !cached.open(indexFileName, cachedOptions) || !evicting.open(indexFileName, evictingOptions))
+	{
+		printf("%s: %s%s%s%s\n", format.c_str(), index.lastError().c_str(), mapped.lastError().c_str(), cached.lastError().c_str(), evicting.lastError().c_str());
+		return false;
+	}
+
+	FindResult result;
+	vector<FindResult> results;
+
+	//Warm up the buffers the Index keeps, then count
+	findAll(index, keys, result);
+	startCounting();
+	size_t found = findAll(index, keys, result);
+	stopCounting(format, "find", keys.size());
+
+	if (found != keys.size() - 50)
+	{
+		printf("%s: found %zu of %zu keys\n", format.c_str(), found, keys.size() - 50);
+		return false;
+	}
+
+	index.findBatch(keys, results);
+	startCounting();
+	for (size_t i = 0; i < 5; i++)
+		index.findBatch(keys, results);
+	stopCounting(format, "findBatch", 5);
+
+	mapped.findBatch(keys, results);
+	startCounting();
+	for (size_t i = 0; i < 5; i++)
+		mapped.findBatch(keys, results);
+	stopCounting(format, "findBatch with mmap", 5);
+
+	findAll(cached, keys, result);
+	startCounting();
+	findAll(cached, keys, result);
+	stopCounting(format, "find cached", keys.size());
+
+	cached.findBatch(keys, results);
+	startCounting();
+	for (size_t i = 0; i < 5; i++)
+		cached.findBatch(keys, results);
+	stopCounting(format, "findBatch cached", 5);
+
+	if (cached.cacheStats().entries != keys.size() - 50)
+	{
+		printf("%s: %zu records cached of %zu\n", format.c_str(), cached.cacheStats().entries, keys.size() - 50);
+		return false;
+	}
+
+	//Enough rounds for the spare entries to grow to the longest record
+	for (size_t i = 0; i < 20; i++)
+		findAll(evicting, keys, result);
+	startCounting();
+	findAll(evicting, keys, result);
+	stopCounting(format, "find evicting", keys.size());
+
+	for (size_t i = 0; i < 5; i++)
+		evicting.findBatch(keys, results);
+	startCounting();
+	for (size_t i = 0; i < 5; i++)
+		evicting.findBatch(keys, results);
+	stopCounting(format, "findBatch evicting", 5);
+
+	walkRanges(index, keys);
+	startCounting();
+	size_t records = walkRanges(index, keys);
+	stopCounting(format, "range", records);
+
+	//A reader left on an old snapshot would keep every page the inserts replace on the free list
+	mapped.close();
+	cached.close();
+	evicting.close();
+
+	//Records made before counting; the caller's strings are not the index's allocations
+	vector<string> inserted;
+	for (size_t i = 0; i < 220; i++)
+	{
+		char record[64];
+		snprintf(record, sizeof(record), "9%0*zu inserted record %03zu", (int)KEY_LENGTH - 1, i * 7919, i);
+		inserted.push_back(record);
+	}
+
+	for (size_t i = 0; i < 20; i++)
+		index.insert(inserted[i]);
+
+	startCounting();
+	for (size_t i = 20; i < inserted.size(); i++)
+		index.insert(inserted[i]);
+	stopCounting(format, "insert", inserted.size() - 20);
+
+	if (!index.find(inserted.back().substr(0, KEY_LENGTH), result) || result.record != inserted.back())
+	{
+		printf("%s: the last record inserted was not found\n", format.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 3)
+	{
+		printf("Usage: test_allocations BPIndex sampleData.txt\n");
+		return 1;
+	}
+
+	if (!checkFormat(argv[2], "text", RECORD_FORMAT_TEXT) || !checkFormat(argv[2], "binary", RECORD_FORMAT_BINARY))
+		return 1;
+
+	return failed ? 1 : 0;
+}
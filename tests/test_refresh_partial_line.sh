@@ -0,0 +1,58 @@
+#!/bin/sh
+# A line appended to the text file without its newline yet may still be
+# being written. Neither -create nor -refresh indexes it, and the -refresh
+# after it is finished indexes it once, without calling it a duplicate.
+# Nor is a line that -insert appended while the index was behind the file.
+
+fail() { echo "$1"; exit 1; }
+
+expect_refresh() {
+	"$BPINDEX" -refresh "$1" > refresh.out || fail "-refresh $1 failed"
+	grep -q "$2 appended records successfully indexed, 0 duplicates" refresh.out || fail "-refresh $1: $(cat refresh.out)"
+}
+
+expect_found() {
+	"$BPINDEX" -find "$1" "$2" > find.out || fail "-find $1 $2 failed"
+	grep -q "record: $3\$" find.out || fail "-find $1 $2 returned $(cat find.out)"
+}
+
+# Appended after the index was created
+cp "$DATA" a.txt
+"$BPINDEX" -create a.txt a.idx 15 > /dev/null || fail "-create failed"
+
+printf '999999999999999 partial' >> a.txt
+expect_refresh a.idx 0
+
+printf ' line\n' >> a.txt
+expect_refresh a.idx 1
+expect_found a.idx 999999999999999 "999999999999999 partial line"
+
+expect_refresh a.idx 0
+
+# Already there when the index was created, in each record format
+for format in text binary columnar; do
+	cp "$DATA" b_$format.txt
+	printf '888888888888888 unfin' >> b_$format.txt
+	"$BPINDEX" -create b_$format.txt b_$format.idx 15 --record-format=$format > /dev/null || fail "-create $format failed"
+
+	printf 'ished\n' >> b_$format.txt
+	expect_refresh b_$format.idx 1
+	expect_found b_$format.idx 888888888888888 "888888888888888 unfinished"
+done
+
+# Inserted while lines appended by others were not indexed yet
+cp "$DATA" c.txt
+"$BPINDEX" -create c.txt c.idx 15 > /dev/null || fail "-create failed"
+
+for i in 0 1 2 3 4 5 6 7 8 9; do
+	echo "88888888888880$i appended $i" >> c.txt
+done
+
+"$BPINDEX" -insert c.idx "777777777777777 inserted" > insert.out || fail "-insert failed"
+grep -q "Record successfully inserted" insert.out || fail "-insert returned $(cat insert.out)"
+
+expect_refresh c.idx 10
+expect_found c.idx 777777777777777 "777777777777777 inserted"
+expect_found c.idx 888888888888809 "888888888888809 appended 9"
+
+exit 0
@@ -0,0 +1,39 @@
+#!/bin/sh
+# Batch inserts into a sharded text index. The shards insert on parallel
+# threads, but all append to the one text file, so every record has to
+# land on a line of its own and be found again at that line. A shard
+# written to on its own only takes keys in its range.
+
+fail() { echo "$1"; exit 1; }
+
+cp "$DATA" sA.txt
+before=$(wc -l < sA.txt)
+
+"$BPINDEX" -create sA.txt s.idx 15 --shards=4 > /dev/null || fail "-create failed"
+
+# Keys spread over every shard, none of them in the sample data
+awk 'BEGIN { for (i = 0; i < 20000; i++) printf "%d%013dZ inserted record %d\n", i % 10, i, i }' > new.txt
+
+"$BPINDEX" -insertbatch s.idx new.txt > insert.out || fail "-insertbatch failed"
+grep -q "20000 records successfully inserted, 0 duplicates" insert.out || fail "not every record was inserted: $(cat insert.out)"
+
+after=$(wc -l < sA.txt)
+[ "$after" -eq $((before + 20000)) ] || fail "text file has $after lines, expected $((before + 20000))"
+
+# Every key is found, and at a line holding exactly its own record
+cut -d' ' -f1 new.txt > keys.txt
+"$BPINDEX" -findbatch s.idx keys.txt > found.out || fail "-findbatch failed"
+sed -n 's/^At [0-9]*, record: //p' found.out > found.txt
+cmp -s found.txt new.txt || fail "records found differ from the records inserted"
+
+"$BPINDEX" -find s.idx 70000000019997Z > find.out || fail "-find failed"
+grep -q "record: 70000000019997Z inserted record 19997$" find.out || fail "-find returned $(cat find.out)"
+
+# A shard written to on its own turns away the keys of the other shards
+"$BPINDEX" -insert s.idx.0 "FFFFFFFFFFFFFFF wrong shard" > wrong.out
+grep -q "^Error: Key belongs to another shard" wrong.out || fail "-insert into the wrong shard returned $(cat wrong.out)"
+
+"$BPINDEX" -verify s.idx > verify.out || fail "-verify failed"
+grep -q "index is sound" verify.out || fail "-verify reported $(cat verify.out)"
+
+exit 0